@@ -4,14 +4,18 @@
 #include <nvi/API.h>
 #include <QMainWindow>
 #include "obs-nvi.h"
+#include "nvi-recv-pool.h"
+#include "nvi-discovery.h"
+#include "nvi-send-bench.h"
 #include <qmessagebox.h>
 OBS_DECLARE_MODULE()
 
 NVI_CONTEXT g_nvi_ctx = nullptr;
-std::vector<NVINetworkStream> g_nvi_streams;
 struct obs_source_info nvi_source_info;
 struct obs_output_info nvi_output_info;
+struct obs_output_info nvi_encoded_output_info;
 obs_output_t *main_out = nullptr;
+obs_output_t *encoded_out = nullptr;
 
 MODULE_EXPORT const char *obs_module_description(void)
 {
@@ -30,6 +34,9 @@ bool obs_module_load(void)
 		nvi_output_info = create_nvi_output_info();
 		obs_register_output(&nvi_output_info);
 
+		nvi_encoded_output_info = create_nvi_encoded_output_info();
+		obs_register_output(&nvi_encoded_output_info);
+
 		
 		QMainWindow *main_window = (QMainWindow *)obs_frontend_get_main_window();
 		QAction *menu_action = (QAction *)obs_frontend_add_tools_menu_qaction("Start NVI Output");
@@ -46,9 +53,41 @@ bool obs_module_load(void)
 			}
 		};
 		menu_action->connect(menu_action, &QAction::triggered, menu_cb);
+
+		/* shares the streaming encoders, so nvi costs no extra encode */
+		QAction *encoded_action =
+			(QAction *)obs_frontend_add_tools_menu_qaction("Start NVI Output (Stream Encoders)");
+		auto encoded_cb = [] {
+			if (encoded_out)
+				return;
+			obs_output_t *stream = obs_frontend_get_streaming_output();
+			obs_encoder_t *video = stream ? obs_output_get_video_encoder(stream) : nullptr;
+			obs_encoder_t *audio = stream ? obs_output_get_audio_encoder(stream, 0) : nullptr;
+			if (!video && !audio) {
+				obs_output_release(stream);
+				QMessageBox::information(nullptr, "Error",
+							 "NVI Output needs the streaming encoders, start streaming once first",
+							 QMessageBox::Ok);
+				return;
+			}
+			obs_data_t *settings = obs_data_create();
+			obs_data_set_string(settings, "nvi_name", "obs encoded");
+			encoded_out = obs_output_create("nvi_output_encoded", "NVI Encoded Output", settings, nullptr);
+			obs_data_release(settings);
+			obs_output_set_video_encoder(encoded_out, video);
+			obs_output_set_audio_encoder(encoded_out, audio, 0);
+			obs_output_release(stream);
+			/* an unsupported codec fails here, let the entry be tried again */
+			if (!obs_output_start(encoded_out)) {
+				obs_output_release(encoded_out);
+				encoded_out = nullptr;
+				QMessageBox::information(nullptr, "Error", "NVI Encoded Output Failed", QMessageBox::Ok);
+			}
+		};
+		encoded_action->connect(encoded_action, &QAction::triggered, encoded_cb);
 		blog(LOG_INFO, "nvi loaded successfully");
 		g_nvi_ctx = NVIContextCreate(nullptr);
-		nvi_discovery();
+		nvi_discovery_start(g_nvi_ctx);
 		return true;
 	}
 
@@ -64,14 +103,8 @@ void obs_module_post_load(void)
 void obs_module_unload(void)
 {
 	obs_output_release(main_out);
-}
-
-void nvi_discovery()
-{
-	g_nvi_streams.resize(10);
-	NVINetworkEnumParam enumparam{};
-	enumparam.streams = g_nvi_streams.data();
-	enumparam.streams_size = (uint32_t)g_nvi_streams.size();
-	enumparam.timeout_ms = 1500;
-	NVINetworkEnumStream(g_nvi_ctx, &enumparam);
+	obs_output_release(encoded_out);
+	nvi_send_bench_stop();
+	nvi_discovery_stop();
+	nvi_recv_pool_shutdown();
 }
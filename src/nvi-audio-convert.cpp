@@ -0,0 +1,741 @@
+#include "nvi-audio-convert.h"
+#include <limits>
+#include <math.h>
+#include <string.h>
+
+/* test builds: NVI_AUDIO_FORCE_SCALAR takes the portable kernels on any
+ * cpu, NVI_AUDIO_NO_AVX2=1 keeps x86 on sse2 */
+#ifndef NVI_AUDIO_NO_AVX2
+#define NVI_AUDIO_NO_AVX2 0
+#endif
+
+#if defined(NVI_AUDIO_FORCE_SCALAR)
+#elif defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__)
+#define NVI_AUDIO_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define NVI_AUDIO_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define NVI_TARGET_AVX2
+#define NVI_INLINE __forceinline
+#else
+#define NVI_TARGET_AVX2 __attribute__((target("avx2")))
+#define NVI_INLINE inline __attribute__((always_inline))
+#endif
+
+typedef void (*nvi_interleave_fn)(const uint8_t *const *planes, float *packed, size_t frames, size_t channels);
+
+template<class T> static inline float nvi_sample_scale()
+{
+	return std::numeric_limits<T>::is_integer ? 1.0f / float(std::numeric_limits<T>::max()) : 1.0f;
+}
+
+template<class T> static inline float nvi_sample_to_float(T value, float scale)
+{
+	return std::numeric_limits<T>::is_integer ? float(value) * scale : float(value);
+}
+
+/* N == 0: channel count only known at run time */
+template<class T, int N>
+static void nvi_interleave_scalar(const uint8_t *const *planes, float *packed, size_t frames, size_t channels)
+{
+	const size_t n = N ? N : channels;
+	const float scale = nvi_sample_scale<T>();
+
+	for (size_t ch = 0; ch < n; ch++) {
+		const T *src = (const T *)planes[ch];
+		float *dst = packed + ch;
+		for (size_t i = 0; i < frames; i++)
+			dst[i * n] = nvi_sample_to_float(src[i], scale);
+	}
+}
+
+/* the last frames % width samples and odd leftover channels */
+template<class T>
+static inline void nvi_interleave_tail(const uint8_t *const *planes, float *packed, size_t n, size_t ch_begin,
+				       size_t begin, size_t end, float scale)
+{
+	for (size_t ch = ch_begin; ch < n; ch++) {
+		const T *src = (const T *)planes[ch];
+		for (size_t i = begin; i < end; i++)
+			packed[i * n + ch] = nvi_sample_to_float(src[i], scale);
+	}
+}
+
+typedef void (*nvi_deinterleave_fn)(const uint8_t *packed, float *const *planes, size_t frames, size_t channels);
+
+template<class T> static inline float nvi_planar_scale()
+{
+	return std::numeric_limits<T>::is_integer ? 1.0f / (float(std::numeric_limits<T>::max()) + 1.0f) : 1.0f;
+}
+
+template<class T>
+static inline void nvi_deinterleave_tail(const T *in, float *const *planes, size_t n, size_t begin, size_t end,
+					 float scale)
+{
+	for (size_t i = begin; i < end; i++)
+		for (size_t ch = 0; ch < n; ch++)
+			planes[ch][i] = nvi_sample_to_float(in[i * n + ch], scale);
+}
+
+#if !defined(NVI_AUDIO_X86) && !defined(NVI_AUDIO_NEON)
+template<class T>
+static void nvi_deinterleave_scalar(const uint8_t *packed, float *const *planes, size_t frames, size_t channels)
+{
+	nvi_deinterleave_tail<T>((const T *)packed, planes, channels, 0, frames, nvi_planar_scale<T>());
+}
+#endif
+
+typedef void (*nvi_pack_fn)(const float *in, uint8_t *out, size_t samples, nvi_dither *dither);
+
+static inline uint32_t nvi_xorshift(uint32_t &x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/* [0, 1) from the top 23 bits */
+static inline float nvi_uniform(uint32_t &x)
+{
+	uint32_t bits = (nvi_xorshift(x) >> 9) | 0x3f800000u;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value - 1.0f;
+}
+
+/* scale to full range, add +-1 lsb triangular noise, clamp to the target range */
+static inline float nvi_quantize(float v, float full, nvi_dither *dither)
+{
+	v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+	v *= full;
+	if (dither)
+		v += nvi_uniform(dither->state[0]) - nvi_uniform(dither->state[0]);
+	return v < -full - 1.0f ? -full - 1.0f : (v > full ? full : v);
+}
+
+static void nvi_pack_s16_tail(const float *in, uint8_t *out, size_t begin, size_t samples, nvi_dither *dither)
+{
+	for (size_t i = begin; i < samples; i++) {
+		int16_t v = (int16_t)lrintf(nvi_quantize(in[i], 32767.0f, dither));
+		memcpy(out + i * 2, &v, sizeof(v));
+	}
+}
+
+static void nvi_pack_s24_tail(const float *in, uint8_t *out, size_t begin, size_t samples, nvi_dither *dither)
+{
+	for (size_t i = begin; i < samples; i++) {
+		int32_t v = (int32_t)lrintf(nvi_quantize(in[i], 8388607.0f, dither));
+		out[i * 3] = (uint8_t)v;
+		out[i * 3 + 1] = (uint8_t)(v >> 8);
+		out[i * 3 + 2] = (uint8_t)(v >> 16);
+	}
+}
+
+#if !defined(NVI_AUDIO_X86) && !defined(NVI_AUDIO_NEON)
+static void nvi_pack_s16_scalar(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	nvi_pack_s16_tail(in, out, 0, samples, dither);
+}
+
+static void nvi_pack_s24_scalar(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	nvi_pack_s24_tail(in, out, 0, samples, dither);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* 4-wide kernels, SSE2 and NEON share the shuffle structure                 */
+
+#if defined(NVI_AUDIO_X86)
+struct nvi_isa_sse2 {
+	typedef __m128 V;
+
+	static NVI_INLINE V scale(float s) { return _mm_set1_ps(s); }
+	static NVI_INLINE V load(const float *p, V) { return _mm_loadu_ps(p); }
+	static NVI_INLINE V load(const int16_t *p, V s)
+	{
+		__m128i v = _mm_loadl_epi64((const __m128i *)p);
+		v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		return _mm_mul_ps(_mm_cvtepi32_ps(v), s);
+	}
+	static NVI_INLINE V load(const uint8_t *p, V s)
+	{
+		int32_t bytes;
+		memcpy(&bytes, p, sizeof(bytes));
+		__m128i zero = _mm_setzero_si128();
+		__m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+		v = _mm_unpacklo_epi16(v, zero);
+		return _mm_mul_ps(_mm_cvtepi32_ps(v), s);
+	}
+	static NVI_INLINE void store(float *p, V v) { _mm_storeu_ps(p, v); }
+	static NVI_INLINE void store_lo(float *p, V v) { _mm_storel_pi((__m64 *)p, v); }
+	static NVI_INLINE void store_hi(float *p, V v) { _mm_storeh_pi((__m64 *)p, v); }
+	static NVI_INLINE void zip(V a, V b, V &lo, V &hi)
+	{
+		lo = _mm_unpacklo_ps(a, b);
+		hi = _mm_unpackhi_ps(a, b);
+	}
+	static NVI_INLINE void transpose(V &r0, V &r1, V &r2, V &r3) { _MM_TRANSPOSE4_PS(r0, r1, r2, r3); }
+};
+#endif
+
+#if defined(NVI_AUDIO_NEON)
+struct nvi_isa_neon {
+	typedef float32x4_t V;
+
+	static NVI_INLINE V scale(float s) { return vdupq_n_f32(s); }
+	static NVI_INLINE V load(const float *p, V) { return vld1q_f32(p); }
+	static NVI_INLINE V load(const int16_t *p, V s)
+	{
+		return vmulq_f32(vcvtq_f32_s32(vmovl_s16(vld1_s16(p))), s);
+	}
+	static NVI_INLINE V load(const uint8_t *p, V s)
+	{
+		uint32_t bytes;
+		memcpy(&bytes, p, sizeof(bytes));
+		uint16x8_t v = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bytes)));
+		return vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(v))), s);
+	}
+	static NVI_INLINE void store(float *p, V v) { vst1q_f32(p, v); }
+	static NVI_INLINE void store_lo(float *p, V v) { vst1_f32(p, vget_low_f32(v)); }
+	static NVI_INLINE void store_hi(float *p, V v) { vst1_f32(p, vget_high_f32(v)); }
+	static NVI_INLINE void zip(V a, V b, V &lo, V &hi)
+	{
+		float32x4x2_t z = vzipq_f32(a, b);
+		lo = z.val[0];
+		hi = z.val[1];
+	}
+	static NVI_INLINE void transpose(V &r0, V &r1, V &r2, V &r3)
+	{
+		float32x4x2_t p01 = vtrnq_f32(r0, r1);
+		float32x4x2_t p23 = vtrnq_f32(r2, r3);
+		r0 = vcombine_f32(vget_low_f32(p01.val[0]), vget_low_f32(p23.val[0]));
+		r1 = vcombine_f32(vget_low_f32(p01.val[1]), vget_low_f32(p23.val[1]));
+		r2 = vcombine_f32(vget_high_f32(p01.val[0]), vget_high_f32(p23.val[0]));
+		r3 = vcombine_f32(vget_high_f32(p01.val[1]), vget_high_f32(p23.val[1]));
+	}
+};
+#endif
+
+#if defined(NVI_AUDIO_X86)
+static inline __m128 nvi_sse2_uniform(__m128i &x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	__m128i bits = _mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000));
+	return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+}
+
+static inline __m128i nvi_sse2_quantize(__m128 v, float full, __m128i *x)
+{
+	v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+	v = _mm_mul_ps(v, _mm_set1_ps(full));
+	if (x)
+		v = _mm_add_ps(v, _mm_sub_ps(nvi_sse2_uniform(*x), nvi_sse2_uniform(*x)));
+	v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-full - 1.0f)), _mm_set1_ps(full));
+	return _mm_cvtps_epi32(v);
+}
+
+static void nvi_pack_s16_sse2(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither->state) : _mm_setzero_si128();
+	__m128i *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i a = nvi_sse2_quantize(_mm_loadu_ps(in + i), 32767.0f, x);
+		__m128i b = nvi_sse2_quantize(_mm_loadu_ps(in + i + 4), 32767.0f, x);
+		_mm_storeu_si128((__m128i *)(out + i * 2), _mm_packs_epi32(a, b));
+	}
+
+	if (dither)
+		_mm_storeu_si128((__m128i *)dither->state, state);
+	nvi_pack_s16_tail(in, out, i, samples, dither);
+}
+
+/* no byte shuffle before SSSE3, the 3-byte stores stay scalar */
+static void nvi_pack_s24_sse2(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	__m128i state = dither ? _mm_loadu_si128((const __m128i *)dither->state) : _mm_setzero_si128();
+	__m128i *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		int32_t v[4];
+		_mm_storeu_si128((__m128i *)v, nvi_sse2_quantize(_mm_loadu_ps(in + i), 8388607.0f, x));
+		uint8_t *dst = out + i * 3;
+		for (int k = 0; k < 4; k++) {
+			dst[k * 3] = (uint8_t)v[k];
+			dst[k * 3 + 1] = (uint8_t)(v[k] >> 8);
+			dst[k * 3 + 2] = (uint8_t)(v[k] >> 16);
+		}
+	}
+
+	if (dither)
+		_mm_storeu_si128((__m128i *)dither->state, state);
+	nvi_pack_s24_tail(in, out, i, samples, dither);
+}
+#endif
+
+#if defined(NVI_AUDIO_NEON)
+static inline float32x4_t nvi_neon_uniform(uint32x4_t &x)
+{
+	x = veorq_u32(x, vshlq_n_u32(x, 13));
+	x = veorq_u32(x, vshrq_n_u32(x, 17));
+	x = veorq_u32(x, vshlq_n_u32(x, 5));
+	uint32x4_t bits = vorrq_u32(vshrq_n_u32(x, 9), vdupq_n_u32(0x3f800000));
+	return vsubq_f32(vreinterpretq_f32_u32(bits), vdupq_n_f32(1.0f));
+}
+
+static inline int32x4_t nvi_neon_quantize(float32x4_t v, float full, uint32x4_t *x)
+{
+	v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(-1.0f)), vdupq_n_f32(1.0f));
+	v = vmulq_n_f32(v, full);
+	if (x)
+		v = vaddq_f32(v, vsubq_f32(nvi_neon_uniform(*x), nvi_neon_uniform(*x)));
+	v = vminq_f32(vmaxq_f32(v, vdupq_n_f32(-full - 1.0f)), vdupq_n_f32(full));
+	return vcvtnq_s32_f32(v);
+}
+
+static void nvi_pack_s16_neon(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(0);
+	uint32x4_t *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		int32x4_t a = nvi_neon_quantize(vld1q_f32(in + i), 32767.0f, x);
+		int32x4_t b = nvi_neon_quantize(vld1q_f32(in + i + 4), 32767.0f, x);
+		vst1q_s16((int16_t *)(out + i * 2), vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+
+	if (dither)
+		vst1q_u32(dither->state, state);
+	nvi_pack_s16_tail(in, out, i, samples, dither);
+}
+
+static void nvi_pack_s24_neon(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	uint32x4_t state = dither ? vld1q_u32(dither->state) : vdupq_n_u32(0);
+	uint32x4_t *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		int32_t v[4];
+		vst1q_s32(v, nvi_neon_quantize(vld1q_f32(in + i), 8388607.0f, x));
+		uint8_t *dst = out + i * 3;
+		for (int k = 0; k < 4; k++) {
+			dst[k * 3] = (uint8_t)v[k];
+			dst[k * 3 + 1] = (uint8_t)(v[k] >> 8);
+			dst[k * 3 + 2] = (uint8_t)(v[k] >> 16);
+		}
+	}
+
+	if (dither)
+		vst1q_u32(dither->state, state);
+	nvi_pack_s24_tail(in, out, i, samples, dither);
+}
+#endif
+
+#if defined(NVI_AUDIO_X86) || defined(NVI_AUDIO_NEON)
+template<class S, class T, int N>
+static void nvi_interleave_x4(const uint8_t *const *planes, float *packed, size_t frames, size_t channels)
+{
+	typedef typename S::V V;
+	const size_t n = N ? N : channels;
+	const float scale = nvi_sample_scale<T>();
+	const V vscale = S::scale(scale);
+	const T *const *in = (const T *const *)planes;
+	const size_t body = frames & ~(size_t)3;
+	size_t c_end = 0;
+
+	for (size_t i = 0; i < body; i += 4) {
+		float *dst = packed + i * n;
+		size_t c = 0;
+
+		if (n == 1) {
+			S::store(dst, S::load(in[0] + i, vscale));
+			c = 1;
+		} else if (n == 2) {
+			V lo, hi;
+			S::zip(S::load(in[0] + i, vscale), S::load(in[1] + i, vscale), lo, hi);
+			S::store(dst, lo);
+			S::store(dst + 4, hi);
+			c = 2;
+		}
+
+		for (; c + 4 <= n; c += 4) {
+			V r0 = S::load(in[c] + i, vscale);
+			V r1 = S::load(in[c + 1] + i, vscale);
+			V r2 = S::load(in[c + 2] + i, vscale);
+			V r3 = S::load(in[c + 3] + i, vscale);
+			S::transpose(r0, r1, r2, r3);
+			S::store(dst + c, r0);
+			S::store(dst + n + c, r1);
+			S::store(dst + 2 * n + c, r2);
+			S::store(dst + 3 * n + c, r3);
+		}
+
+		if (c + 2 <= n) {
+			V lo, hi;
+			S::zip(S::load(in[c] + i, vscale), S::load(in[c + 1] + i, vscale), lo, hi);
+			S::store_lo(dst + c, lo);
+			S::store_hi(dst + n + c, lo);
+			S::store_lo(dst + 2 * n + c, hi);
+			S::store_hi(dst + 3 * n + c, hi);
+			c += 2;
+		}
+		c_end = c;
+	}
+
+	if (body && c_end < n)
+		nvi_interleave_tail<T>(planes, packed, n, c_end, 0, body, scale);
+	nvi_interleave_tail<T>(planes, packed, n, 0, body, frames, scale);
+}
+#endif
+
+#if defined(NVI_AUDIO_X86) || defined(NVI_AUDIO_NEON)
+/* four frames by four channels per transpose; a ragged last group overlaps
+ * the previous one and rewrites the shared channels with the same values */
+template<class S, class T>
+static void nvi_deinterleave_x4(const uint8_t *packed, float *const *planes, size_t frames, size_t channels)
+{
+	typedef typename S::V V;
+	const size_t n = channels;
+	const float scale = nvi_planar_scale<T>();
+	const V vscale = S::scale(scale);
+	const T *in = (const T *)packed;
+	const size_t body = n >= 4 ? frames & ~(size_t)3 : 0;
+
+	for (size_t i = 0; i < body; i += 4) {
+		const T *src = in + i * n;
+		for (size_t c = 0; c < n; c += 4) {
+			if (c + 4 > n)
+				c = n - 4;
+			V r0 = S::load(src + c, vscale);
+			V r1 = S::load(src + n + c, vscale);
+			V r2 = S::load(src + 2 * n + c, vscale);
+			V r3 = S::load(src + 3 * n + c, vscale);
+			S::transpose(r0, r1, r2, r3);
+			S::store(planes[c] + i, r0);
+			S::store(planes[c + 1] + i, r1);
+			S::store(planes[c + 2] + i, r2);
+			S::store(planes[c + 3] + i, r3);
+		}
+	}
+
+	nvi_deinterleave_tail<T>(in, planes, n, body, frames, scale);
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+/* 8-wide AVX2, per-128-bit-lane shuffles: lane 0 = samples 0..3, lane 1 = 4..7 */
+
+#if defined(NVI_AUDIO_X86)
+NVI_TARGET_AVX2 static inline __m256 nvi_avx2_load(const float *p, __m256)
+{
+	return _mm256_loadu_ps(p);
+}
+
+NVI_TARGET_AVX2 static inline __m256 nvi_avx2_load(const int16_t *p, __m256 s)
+{
+	__m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(v), s);
+}
+
+NVI_TARGET_AVX2 static inline __m256 nvi_avx2_load(const uint8_t *p, __m256 s)
+{
+	__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(v), s);
+}
+
+/* writes sample j of lane 0 at dst + j*n and of lane 1 at dst + (j+4)*n */
+NVI_TARGET_AVX2 static inline void nvi_avx2_store_split(float *dst, size_t n, size_t j, __m256 v)
+{
+	_mm_storeu_ps(dst + j * n, _mm256_castps256_ps128(v));
+	_mm_storeu_ps(dst + (j + 4) * n, _mm256_extractf128_ps(v, 1));
+}
+
+template<class T, int N>
+NVI_TARGET_AVX2 static void nvi_interleave_avx2(const uint8_t *const *planes, float *packed, size_t frames,
+						size_t channels)
+{
+	const size_t n = N ? N : channels;
+	const float scale = nvi_sample_scale<T>();
+	const __m256 vscale = _mm256_set1_ps(scale);
+	const T *const *in = (const T *const *)planes;
+	const size_t body = frames & ~(size_t)7;
+	size_t c_end = 0;
+
+	for (size_t i = 0; i < body; i += 8) {
+		float *dst = packed + i * n;
+		size_t c = 0;
+
+		if (n == 1) {
+			_mm256_storeu_ps(dst, nvi_avx2_load(in[0] + i, vscale));
+			c = 1;
+		} else if (n == 2) {
+			__m256 a = nvi_avx2_load(in[0] + i, vscale);
+			__m256 b = nvi_avx2_load(in[1] + i, vscale);
+			__m256 lo = _mm256_unpacklo_ps(a, b);
+			__m256 hi = _mm256_unpackhi_ps(a, b);
+			_mm256_storeu_ps(dst, _mm256_permute2f128_ps(lo, hi, 0x20));
+			_mm256_storeu_ps(dst + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+			c = 2;
+		}
+
+		for (; c + 4 <= n; c += 4) {
+			__m256 r0 = nvi_avx2_load(in[c] + i, vscale);
+			__m256 r1 = nvi_avx2_load(in[c + 1] + i, vscale);
+			__m256 r2 = nvi_avx2_load(in[c + 2] + i, vscale);
+			__m256 r3 = nvi_avx2_load(in[c + 3] + i, vscale);
+			__m256 t0 = _mm256_unpacklo_ps(r0, r1);
+			__m256 t1 = _mm256_unpackhi_ps(r0, r1);
+			__m256 t2 = _mm256_unpacklo_ps(r2, r3);
+			__m256 t3 = _mm256_unpackhi_ps(r2, r3);
+			nvi_avx2_store_split(dst + c, n, 0, _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)));
+			nvi_avx2_store_split(dst + c, n, 1, _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)));
+			nvi_avx2_store_split(dst + c, n, 2, _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)));
+			nvi_avx2_store_split(dst + c, n, 3, _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)));
+		}
+
+		if (c + 2 <= n) {
+			__m256 a = nvi_avx2_load(in[c] + i, vscale);
+			__m256 b = nvi_avx2_load(in[c + 1] + i, vscale);
+			__m256 lo = _mm256_unpacklo_ps(a, b);
+			__m256 hi = _mm256_unpackhi_ps(a, b);
+			__m128 lo0 = _mm256_castps256_ps128(lo), lo1 = _mm256_extractf128_ps(lo, 1);
+			__m128 hi0 = _mm256_castps256_ps128(hi), hi1 = _mm256_extractf128_ps(hi, 1);
+			_mm_storel_pi((__m64 *)(dst + c), lo0);
+			_mm_storeh_pi((__m64 *)(dst + n + c), lo0);
+			_mm_storel_pi((__m64 *)(dst + 2 * n + c), hi0);
+			_mm_storeh_pi((__m64 *)(dst + 3 * n + c), hi0);
+			_mm_storel_pi((__m64 *)(dst + 4 * n + c), lo1);
+			_mm_storeh_pi((__m64 *)(dst + 5 * n + c), lo1);
+			_mm_storel_pi((__m64 *)(dst + 6 * n + c), hi1);
+			_mm_storeh_pi((__m64 *)(dst + 7 * n + c), hi1);
+			c += 2;
+		}
+		c_end = c;
+	}
+
+	if (body && c_end < n)
+		nvi_interleave_tail<T>(planes, packed, n, c_end, 0, body, scale);
+	nvi_interleave_tail<T>(planes, packed, n, 0, body, frames, scale);
+}
+
+NVI_TARGET_AVX2 static inline __m256 nvi_avx2_uniform(__m256i &x)
+{
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+	__m256i bits = _mm256_or_si256(_mm256_srli_epi32(x, 9), _mm256_set1_epi32(0x3f800000));
+	return _mm256_sub_ps(_mm256_castsi256_ps(bits), _mm256_set1_ps(1.0f));
+}
+
+NVI_TARGET_AVX2 static inline __m256i nvi_avx2_quantize(__m256 v, float full, __m256i *x)
+{
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+	v = _mm256_mul_ps(v, _mm256_set1_ps(full));
+	if (x)
+		v = _mm256_add_ps(v, _mm256_sub_ps(nvi_avx2_uniform(*x), nvi_avx2_uniform(*x)));
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-full - 1.0f)), _mm256_set1_ps(full));
+	return _mm256_cvtps_epi32(v);
+}
+
+NVI_TARGET_AVX2 static void nvi_pack_s16_avx2(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	__m256i state = dither ? _mm256_loadu_si256((const __m256i *)dither->state) : _mm256_setzero_si256();
+	__m256i *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m256i a = nvi_avx2_quantize(_mm256_loadu_ps(in + i), 32767.0f, x);
+		__m256i b = nvi_avx2_quantize(_mm256_loadu_ps(in + i + 8), 32767.0f, x);
+		/* packs works per lane: a0-3 b0-3 | a4-7 b4-7 */
+		__m256i v = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *)(out + i * 2), v);
+	}
+
+	if (dither)
+		_mm256_storeu_si256((__m256i *)dither->state, state);
+	nvi_pack_s16_tail(in, out, i, samples, dither);
+}
+
+NVI_TARGET_AVX2 static void nvi_pack_s24_avx2(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1, 0, 1, 2, 4,
+						 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i state = dither ? _mm256_loadu_si256((const __m256i *)dither->state) : _mm256_setzero_si256();
+	__m256i *x = dither ? &state : nullptr;
+	size_t i = 0;
+
+	/* each 16-byte store spills 4 bytes, keep two samples of room behind it */
+	for (; i + 10 <= samples; i += 8) {
+		__m256i v = nvi_avx2_quantize(_mm256_loadu_ps(in + i), 8388607.0f, x);
+		v = _mm256_shuffle_epi8(v, shuffle);
+		uint8_t *dst = out + i * 3;
+		_mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(dst + 12), _mm256_extracti128_si256(v, 1));
+	}
+
+	if (dither)
+		_mm256_storeu_si256((__m256i *)dither->state, state);
+	nvi_pack_s24_tail(in, out, i, samples, dither);
+}
+
+static bool nvi_cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+	__cpuid(regs, 1);
+	bool osxsave = (regs[2] & (1 << 27)) != 0;
+	bool avx = (regs[2] & (1 << 28)) != 0;
+	if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+		return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+enum { NVI_CH_1, NVI_CH_2, NVI_CH_6, NVI_CH_8, NVI_CH_ANY, NVI_CH_COUNT };
+
+struct nvi_audio_kernels {
+	const char *isa;
+	nvi_interleave_fn interleave[3][NVI_CH_COUNT];
+	nvi_deinterleave_fn deinterleave[2];
+	nvi_pack_fn pack_s16;
+	nvi_pack_fn pack_s24;
+};
+
+#define NVI_KERNEL_ROW(fn, T) {fn<T, 1>, fn<T, 2>, fn<T, 6>, fn<T, 8>, fn<T, 0>}
+#define NVI_KERNEL_TABLE(fn)                                                                      \
+	{                                                                                         \
+		NVI_KERNEL_ROW(fn, uint8_t), NVI_KERNEL_ROW(fn, int16_t), NVI_KERNEL_ROW(fn, float) \
+	}
+
+#define NVI_DEINTERLEAVE_ROW(fn) {fn<int16_t>, fn<float>}
+
+#if defined(NVI_AUDIO_X86)
+template<class T, int N>
+static void nvi_interleave_sse2(const uint8_t *const *planes, float *packed, size_t frames, size_t channels)
+{
+	nvi_interleave_x4<nvi_isa_sse2, T, N>(planes, packed, frames, channels);
+}
+
+/* loads dominate here, avx2 gains nothing measurable over sse2 */
+template<class T>
+static void nvi_deinterleave_sse2(const uint8_t *packed, float *const *planes, size_t frames, size_t channels)
+{
+	nvi_deinterleave_x4<nvi_isa_sse2, T>(packed, planes, frames, channels);
+}
+#elif defined(NVI_AUDIO_NEON)
+template<class T, int N>
+static void nvi_interleave_neon(const uint8_t *const *planes, float *packed, size_t frames, size_t channels)
+{
+	nvi_interleave_x4<nvi_isa_neon, T, N>(planes, packed, frames, channels);
+}
+
+template<class T>
+static void nvi_deinterleave_neon(const uint8_t *packed, float *const *planes, size_t frames, size_t channels)
+{
+	nvi_deinterleave_x4<nvi_isa_neon, T>(packed, planes, frames, channels);
+}
+#endif
+
+static nvi_audio_kernels nvi_audio_kernels_select()
+{
+#if defined(NVI_AUDIO_X86)
+	if (!NVI_AUDIO_NO_AVX2 && nvi_cpu_has_avx2())
+		return {"avx2", NVI_KERNEL_TABLE(nvi_interleave_avx2), NVI_DEINTERLEAVE_ROW(nvi_deinterleave_sse2),
+			nvi_pack_s16_avx2, nvi_pack_s24_avx2};
+	return {"sse2", NVI_KERNEL_TABLE(nvi_interleave_sse2), NVI_DEINTERLEAVE_ROW(nvi_deinterleave_sse2),
+		nvi_pack_s16_sse2, nvi_pack_s24_sse2};
+#elif defined(NVI_AUDIO_NEON)
+	return {"neon", NVI_KERNEL_TABLE(nvi_interleave_neon), NVI_DEINTERLEAVE_ROW(nvi_deinterleave_neon),
+		nvi_pack_s16_neon, nvi_pack_s24_neon};
+#else
+	return {"scalar", NVI_KERNEL_TABLE(nvi_interleave_scalar), NVI_DEINTERLEAVE_ROW(nvi_deinterleave_scalar),
+		nvi_pack_s16_scalar, nvi_pack_s24_scalar};
+#endif
+}
+
+static const nvi_audio_kernels &nvi_audio_kernels_get()
+{
+	static const nvi_audio_kernels kernels = nvi_audio_kernels_select();
+	return kernels;
+}
+
+void nvi_planar_to_packed_float(nvi_sample_type type, const uint8_t *const *planes, float *packed, size_t frames,
+				size_t channels)
+{
+	size_t slot;
+	switch (channels) {
+	case 1:
+		slot = NVI_CH_1;
+		break;
+	case 2:
+		slot = NVI_CH_2;
+		break;
+	case 6:
+		slot = NVI_CH_6;
+		break;
+	case 8:
+		slot = NVI_CH_8;
+		break;
+	default:
+		slot = NVI_CH_ANY;
+		break;
+	}
+	nvi_audio_kernels_get().interleave[type][slot](planes, packed, frames, channels);
+}
+
+void nvi_packed_to_planar_float(nvi_sample_type type, const uint8_t *packed, float *const *planes, size_t frames,
+				size_t channels)
+{
+	if (type == NVI_SAMPLE_U8)
+		return;
+	nvi_audio_kernels_get().deinterleave[type == NVI_SAMPLE_F32](packed, planes, frames, channels);
+}
+
+void nvi_dither_init(nvi_dither *dither, uint32_t seed)
+{
+	/* xorshift must never see a zero state */
+	for (size_t i = 0; i < 8; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		dither->state[i] = seed ? seed : 0x9e3779b9u;
+	}
+}
+
+void nvi_packed_float_to_s16(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	nvi_audio_kernels_get().pack_s16(in, out, samples, dither);
+}
+
+void nvi_packed_float_to_s24(const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	nvi_audio_kernels_get().pack_s24(in, out, samples, dither);
+}
+
+const char *nvi_audio_convert_isa(void)
+{
+	return nvi_audio_kernels_get().isa;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+enum nvi_sample_type {
+	NVI_SAMPLE_U8,
+	NVI_SAMPLE_S16,
+	NVI_SAMPLE_F32,
+};
+
+/* planar obs samples -> interleaved float, integers scaled by 1/max like
+ * the old PlanarToPackedFloat; picks SSE2/AVX2/NEON/scalar on first use */
+extern void nvi_planar_to_packed_float(nvi_sample_type type, const uint8_t *const *planes, float *packed,
+				       size_t frames, size_t channels);
+
+/* interleaved nvi pcm -> one float plane per channel for obs, s16 scaled by
+ * 1/32768 like obs' own conversion; only NVI_SAMPLE_S16 and NVI_SAMPLE_F32 */
+extern void nvi_packed_to_planar_float(nvi_sample_type type, const uint8_t *packed, float *const *planes,
+				       size_t frames, size_t channels);
+
+/* per-lane xorshift state for TPDF dither, seed once per output */
+struct nvi_dither {
+	uint32_t state[8];
+};
+
+extern void nvi_dither_init(nvi_dither *dither, uint32_t seed);
+
+/* interleaved float -> interleaved host-endian 16/24-bit pcm, clamped and
+ * rounded; `out` may alias `in`, dither may be null */
+extern void nvi_packed_float_to_s16(const float *in, uint8_t *out, size_t samples, nvi_dither *dither);
+extern void nvi_packed_float_to_s24(const float *in, uint8_t *out, size_t samples, nvi_dither *dither);
+
+/* name of the kernel set picked for this cpu, for the log */
+extern const char *nvi_audio_convert_isa(void);
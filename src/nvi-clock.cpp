@@ -0,0 +1,95 @@
+#include "nvi-clock.h"
+#include <math.h>
+#include <string.h>
+
+/* a jump this large is a new stream or a stepped sender clock, not jitter */
+#define NVI_CLOCK_STEP_NS 500000000.0
+#define NVI_CLOCK_WINDOW_NS 2000000000LL
+#define NVI_CLOCK_MAX_DRIFT 0.001
+
+void nvi_clock_reset(nvi_clock *clock)
+{
+	memset(clock, 0, sizeof(*clock));
+}
+
+static int64_t nvi_tick_to_ns(uint64_t ticks, const NVITimeTick *tick)
+{
+	/* split to keep 90 kHz and 48 kHz ticks exact without overflowing */
+	uint64_t num = (uint64_t)tick->freq_num * 1000000000ULL;
+	uint64_t whole = ticks / tick->freq_den;
+	uint64_t rest = ticks % tick->freq_den;
+	return (int64_t)(whole * num + rest * num / tick->freq_den);
+}
+
+/* ticks give the spacing, NVIDateTime puts both tracks on one sender time base */
+static int64_t nvi_clock_sender_ns(nvi_clock_track *track, const NVITimeTick *tick, NVIDateTime time,
+				   uint64_t local_ns)
+{
+	int64_t time_ns = time * 1000;
+	if (!tick->freq_den || !tick->freq_num)
+		return time ? time_ns : (int64_t)local_ns;
+
+	if (track->anchored && tick->value >= track->base_tick) {
+		int64_t ns = track->base_ns + nvi_tick_to_ns(tick->value - track->base_tick, tick);
+		if (!time || fabs((double)(ns - time_ns)) < NVI_CLOCK_STEP_NS)
+			return ns;
+	}
+
+	track->anchored = true;
+	track->base_tick = tick->value;
+	track->base_ns = time ? time_ns : (int64_t)local_ns;
+	return track->base_ns;
+}
+
+static void nvi_clock_lock(nvi_clock *clock, int64_t sender_ns, double sample)
+{
+	clock->locked = true;
+	clock->offset = sample;
+	clock->drift = 0.0;
+	clock->last_sender_ns = sender_ns;
+	clock->window_sender_ns = sender_ns;
+	clock->window_min = sample;
+	clock->last_window_min = NAN;
+	clock->resets++;
+}
+
+uint64_t nvi_clock_map(nvi_clock *clock, nvi_clock_track *track, const NVITimeTick *tick, NVIDateTime time,
+		       uint64_t local_ns)
+{
+	int64_t sender_ns = nvi_clock_sender_ns(track, tick, time, local_ns);
+	double sample = (double)local_ns - (double)sender_ns;
+
+	double predicted = clock->offset + clock->drift * (double)(sender_ns - clock->last_sender_ns);
+	if (!clock->locked || fabs(sample - predicted) > NVI_CLOCK_STEP_NS) {
+		nvi_clock_lock(clock, sender_ns, sample);
+	} else {
+		/* network delay only ever adds, so follow early arrivals quickly
+		 * and late ones slowly: the offset tracks the fastest path */
+		double err = sample - predicted;
+		clock->offset = predicted + err * (err < 0.0 ? 0.25 : 1.0 / 64.0);
+		clock->last_sender_ns = sender_ns;
+
+		/* drift from the slope of the per-window minimum delay, which
+		 * queueing jitter barely moves */
+		clock->window_min = fmin(clock->window_min, sample);
+		int64_t span = sender_ns - clock->window_sender_ns;
+		if (span >= NVI_CLOCK_WINDOW_NS) {
+			if (!isnan(clock->last_window_min)) {
+				double measured = (clock->window_min - clock->last_window_min) / (double)span;
+				double drift = clock->drift + (measured - clock->drift) * 0.25;
+				clock->drift = fmax(-NVI_CLOCK_MAX_DRIFT, fmin(NVI_CLOCK_MAX_DRIFT, drift));
+			}
+			clock->last_window_min = clock->window_min;
+			clock->window_min = sample;
+			clock->window_sender_ns = sender_ns;
+		}
+	}
+
+	/* audio and video may share a tick after a re-anchor, never go backwards */
+	double mapped = (double)sender_ns + clock->offset;
+	uint64_t ns = mapped > 0.0 ? (uint64_t)mapped : 0;
+	if (ns <= track->last_ns && track->last_ns - ns < (uint64_t)NVI_CLOCK_STEP_NS)
+		ns = track->last_ns + 1;
+	track->last_ns = ns;
+	return ns;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <NVI/API.h>
+#include <stdint.h>
+
+/* one media track of a stream, ticks are unwrapped against its own anchor */
+struct nvi_clock_track {
+	bool anchored;
+	uint64_t base_tick;
+	int64_t base_ns;
+	uint64_t last_ns;
+};
+
+/* maps sender time onto os_gettime_ns; audio and video of one stream share
+ * the offset so they stay in sync with each other */
+struct nvi_clock {
+	nvi_clock_track video;
+	nvi_clock_track audio;
+
+	bool locked;
+	double offset;
+	double drift;
+	int64_t last_sender_ns;
+	int64_t window_sender_ns;
+	double window_min;
+	double last_window_min;
+
+	uint64_t resets;
+};
+
+extern void nvi_clock_reset(nvi_clock *clock);
+
+/* local presentation time of a frame that arrived at local_ns */
+extern uint64_t nvi_clock_map(nvi_clock *clock, nvi_clock_track *track, const NVITimeTick *tick, NVIDateTime time,
+			      uint64_t local_ns);
@@ -0,0 +1,305 @@
+#include "nvi-discovery.h"
+#include "nvi-memory.h"
+#include "atomicops.h"
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <string.h>
+
+#define NVI_DISCOVERY_MIN_CAPACITY 64
+#define NVI_DISCOVERY_MAX_CAPACITY 16384
+#define NVI_DISCOVERY_PASSIVE_MS 200
+#define NVI_DISCOVERY_RESCAN_MS 1500
+#define NVI_DISCOVERY_PASSIVE_INTERVAL_NS 1000000000ULL
+#define NVI_DISCOVERY_RESCAN_INTERVAL_NS 30000000000ULL
+/* an entry survives a few missed rescans before it is dropped */
+#define NVI_DISCOVERY_EXPIRE_NS (3 * NVI_DISCOVERY_RESCAN_INTERVAL_NS)
+#define NVI_ARENA_BLOCK 16384
+
+/* append-only string storage, written by the discovery thread only; names
+ * on a network are few and repeat every scan, so nothing is ever freed
+ * before discovery stops */
+struct nvi_string_arena {
+	std::vector<char *> blocks;
+	size_t used = NVI_ARENA_BLOCK;
+	std::unordered_set<std::string_view> strings;
+};
+struct nvi_discovery {
+	NVI_CONTEXT context = nullptr;
+	std::thread thread;
+	moodycamel::spsc_sema::LightweightSemaphore wake;
+	std::atomic<bool> stopping{false};
+	std::atomic<bool> rescan{true};
+
+	/* enumeration buffer, doubled whenever the library fills it */
+	std::vector<NVINetworkStream> found;
+	nvi_stream_snapshot current;
+	nvi_string_arena arena;
+	std::string key;
+
+	std::mutex callbacks_lock;
+	std::vector<std::pair<nvi_discovery_changed_t, void *>> callbacks;
+};
+
+static nvi_discovery discovery;
+
+static const char *nvi_intern(nvi_string_arena *arena, const char *str, size_t len)
+{
+	auto it = arena->strings.find(std::string_view(str, len));
+	if (it != arena->strings.end())
+		return it->data();
+
+	size_t size = len + 1;
+	char *dst;
+	if (size > NVI_ARENA_BLOCK) {
+		/* goes in front of the block being filled, which stays last */
+		dst = (char *)nvi_mem_alloc(size);
+		auto at = arena->blocks.empty() ? arena->blocks.end() : arena->blocks.end() - 1;
+		arena->blocks.insert(at, dst);
+	} else {
+		if (arena->used + size > NVI_ARENA_BLOCK) {
+			arena->blocks.push_back((char *)nvi_mem_alloc(NVI_ARENA_BLOCK));
+			arena->used = 0;
+		}
+		dst = arena->blocks.back() + arena->used;
+		arena->used += size;
+	}
+
+	memcpy(dst, str, len);
+	dst[len] = 0;
+	arena->strings.emplace(dst, len);
+	return dst;
+}
+
+static const char *nvi_intern(nvi_string_arena *arena, const char *str)
+{
+	return nvi_intern(arena, str ? str : "", str ? strlen(str) : 0);
+}
+
+static void nvi_arena_free(nvi_string_arena *arena)
+{
+	for (char *block : arena->blocks)
+		nvi_mem_free(block);
+	arena->blocks.clear();
+	arena->strings.clear();
+	arena->used = NVI_ARENA_BLOCK;
+}
+
+const nvi_stream_entry *nvi_stream_directory::find(uint64_t key_hash, const char *key) const
+{
+	auto range = by_key.equal_range(key_hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		const nvi_stream_entry *entry = &streams[it->second];
+		if (strcmp(entry->key, key) == 0)
+			return entry;
+	}
+	return nullptr;
+}
+
+const nvi_stream_entry *nvi_stream_directory::find(uint32_t instance, uint32_t number) const
+{
+	auto it = by_id.find(nvi_stream_id(instance, number));
+	return it == by_id.end() ? nullptr : &streams[it->second];
+}
+
+static void nvi_discovery_publish(std::shared_ptr<nvi_stream_directory> dir)
+{
+	dir->by_key.clear();
+	dir->by_id.clear();
+	dir->by_key.reserve(dir->streams.size());
+	dir->by_id.reserve(dir->streams.size());
+	for (size_t i = 0; i < dir->streams.size(); i++) {
+		dir->by_key.emplace(dir->streams[i].key_hash, i);
+		dir->by_id[nvi_stream_id(dir->streams[i].instance, dir->streams[i].number)] = i;
+	}
+	std::atomic_store(&discovery.current, nvi_stream_snapshot(std::move(dir)));
+}
+
+/* merges one enumeration into a copy of the directory and publishes it if
+ * anything changed; only the discovery thread writes */
+static bool nvi_discovery_merge(const NVINetworkStream *found, size_t count, uint64_t now)
+{
+	nvi_stream_snapshot old = std::atomic_load(&discovery.current);
+	auto dir = std::make_shared<nvi_stream_directory>(*old);
+	bool changed = false;
+
+	for (size_t i = 0; i < count; i++) {
+		const NVINetworkStream &stream = found[i];
+		if (!stream.alias || !stream.uri)
+			continue;
+
+		/* interned strings compare by pointer from here on */
+		std::string &key = discovery.key;
+		key.assign(stream.sites ? stream.sites : "");
+		key.append(":");
+		key.append(stream.alias);
+		const char *interned = nvi_intern(&discovery.arena, key.c_str(), key.size());
+		uint64_t hash = nvi_stream_key_hash(interned);
+		const char *uri = nvi_intern(&discovery.arena, stream.uri);
+
+		nvi_stream_entry *entry = nullptr;
+		auto range = dir->by_key.equal_range(hash);
+		for (auto it = range.first; it != range.second && !entry; ++it) {
+			if (dir->streams[it->second].key == interned)
+				entry = &dir->streams[it->second];
+		}
+		if (!entry) {
+			dir->by_key.emplace(hash, dir->streams.size());
+			dir->streams.emplace_back();
+			entry = &dir->streams.back();
+			entry->key = interned;
+			entry->key_hash = hash;
+			changed = true;
+		}
+
+		if (entry->uri != uri || entry->instance != stream.instance || entry->number != stream.number)
+			changed = true;
+		entry->alias = nvi_intern(&discovery.arena, stream.alias);
+		entry->sites = nvi_intern(&discovery.arena, stream.sites);
+		entry->uri = uri;
+		entry->tags = nvi_intern(&discovery.arena, stream.tags);
+		entry->number = stream.number;
+		entry->instance = stream.instance;
+		entry->caps_proxy_video = stream.caps_proxy_video;
+		entry->last_seen = now;
+	}
+
+	for (auto it = dir->streams.begin(); it != dir->streams.end();) {
+		if (now - it->last_seen > NVI_DISCOVERY_EXPIRE_NS) {
+			it = dir->streams.erase(it);
+			changed = true;
+		} else {
+			++it;
+		}
+	}
+
+	/* last_seen alone moved, readers do not care */
+	if (changed)
+		nvi_discovery_publish(std::move(dir));
+	else
+		std::atomic_store(&discovery.current, nvi_stream_snapshot(std::move(dir)));
+	return changed;
+}
+
+static void nvi_discovery_notify(void)
+{
+	std::lock_guard<std::mutex> guard(discovery.callbacks_lock);
+	for (auto &callback : discovery.callbacks)
+		callback.first(callback.second);
+}
+
+static void nvi_discovery_enum(bool rescan)
+{
+	int32_t count;
+	for (;;) {
+		std::vector<NVINetworkStream> &found = discovery.found;
+		memset(found.data(), 0, found.size() * sizeof(NVINetworkStream));
+
+		NVINetworkEnumParam param{};
+		param.streams = found.data();
+		param.streams_size = (uint32_t)found.size();
+		param.timeout_ms = rescan ? NVI_DISCOVERY_RESCAN_MS : NVI_DISCOVERY_PASSIVE_MS;
+		param.rescan = rescan;
+
+		count = NVINetworkEnumStream(discovery.context, &param);
+		if (count < 0) {
+			blog(LOG_WARNING, "nvi discovery: enumeration failed (%d)", count);
+			return;
+		}
+
+		/* a full buffer may have been truncated, ask again with more room;
+		 * the streams already seen stay cached so the retry is passive */
+		if ((size_t)count < found.size() || found.size() >= NVI_DISCOVERY_MAX_CAPACITY)
+			break;
+		found.resize(found.size() * 2);
+		rescan = false;
+		blog(LOG_INFO, "nvi discovery: directory grown to %zu streams", found.size());
+	}
+
+	size_t valid = (size_t)count < discovery.found.size() ? (size_t)count : discovery.found.size();
+	if (nvi_discovery_merge(discovery.found.data(), valid, os_gettime_ns()))
+		nvi_discovery_notify();
+}
+
+static void nvi_discovery_thread(void)
+{
+	os_set_thread_name("nvi: discovery");
+	uint64_t next_rescan = 0;
+
+	while (!discovery.stopping) {
+		uint64_t now = os_gettime_ns();
+		bool rescan = discovery.rescan.exchange(false) || now >= next_rescan;
+		if (rescan)
+			next_rescan = now + NVI_DISCOVERY_RESCAN_INTERVAL_NS;
+
+		nvi_discovery_enum(rescan);
+		discovery.wake.wait((std::int64_t)(NVI_DISCOVERY_PASSIVE_INTERVAL_NS / 1000));
+	}
+}
+
+void nvi_discovery_start(NVI_CONTEXT context)
+{
+	if (discovery.thread.joinable())
+		return;
+
+	discovery.context = context;
+	if (discovery.found.size() < NVI_DISCOVERY_MIN_CAPACITY)
+		discovery.found.resize(NVI_DISCOVERY_MIN_CAPACITY);
+	if (!std::atomic_load(&discovery.current))
+		std::atomic_store(&discovery.current, nvi_stream_snapshot(std::make_shared<nvi_stream_directory>()));
+	discovery.stopping = false;
+	discovery.rescan = true;
+	discovery.thread = std::thread(nvi_discovery_thread);
+}
+
+void nvi_discovery_stop(void)
+{
+	if (!discovery.thread.joinable())
+		return;
+
+	discovery.stopping = true;
+	discovery.wake.signal();
+	discovery.thread.join();
+
+	/* every source is gone by now, nothing points into the arena */
+	std::atomic_store(&discovery.current, nvi_stream_snapshot(std::make_shared<nvi_stream_directory>()));
+	nvi_arena_free(&discovery.arena);
+}
+
+void nvi_discovery_refresh(void)
+{
+	discovery.rescan = true;
+	discovery.wake.signal();
+}
+
+nvi_stream_snapshot nvi_discovery_snapshot(void)
+{
+	nvi_stream_snapshot dir = std::atomic_load(&discovery.current);
+	if (!dir)
+		dir = std::make_shared<nvi_stream_directory>();
+	return dir;
+}
+
+void nvi_discovery_add_callback(nvi_discovery_changed_t callback, void *param)
+{
+	std::lock_guard<std::mutex> guard(discovery.callbacks_lock);
+	discovery.callbacks.emplace_back(callback, param);
+}
+
+void nvi_discovery_remove_callback(nvi_discovery_changed_t callback, void *param)
+{
+	std::lock_guard<std::mutex> guard(discovery.callbacks_lock);
+	for (auto it = discovery.callbacks.begin(); it != discovery.callbacks.end(); ++it) {
+		if (it->first == callback && it->second == param) {
+			discovery.callbacks.erase(it);
+			return;
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <NVI/API.h>
+#include <stdint.h>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/* FNV-1a, computed once per entry and once per source setting */
+static inline uint64_t nvi_stream_key_hash(const char *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (; *key; key++)
+		hash = (hash ^ (uint8_t)*key) * 0x100000001b3ULL;
+	return hash;
+}
+
+/* a stream as last announced; the strings are interned in a plugin-owned
+ * arena and stay valid until discovery stops, across rescans */
+struct nvi_stream_entry {
+	const char *key; /* "sites:alias", what source settings store */
+	uint64_t key_hash;
+	const char *alias;
+	const char *sites;
+	const char *uri;
+	const char *tags;
+	uint32_t number;
+	uint32_t instance;
+	bool caps_proxy_video;
+	uint64_t last_seen;
+};
+
+static inline uint64_t nvi_stream_id(uint32_t instance, uint32_t number)
+{
+	return ((uint64_t)instance << 32) | number;
+}
+
+/* immutable once published, readers keep the snapshot alive as long as
+ * they hold the pointer */
+struct nvi_stream_directory {
+	std::vector<nvi_stream_entry> streams;
+	std::unordered_multimap<uint64_t, size_t> by_key;
+	std::unordered_map<uint64_t, size_t> by_id;
+
+	const nvi_stream_entry *find(uint64_t key_hash, const char *key) const;
+	const nvi_stream_entry *find(const char *key) const { return find(nvi_stream_key_hash(key), key); }
+	const nvi_stream_entry *find(uint32_t instance, uint32_t number) const;
+};
+
+typedef std::shared_ptr<const nvi_stream_directory> nvi_stream_snapshot;
+
+typedef void (*nvi_discovery_changed_t)(void *param);
+
+/* runs enumeration on its own thread: passive listening plus a periodic
+ * active rescan, nothing here blocks on the network */
+extern void nvi_discovery_start(NVI_CONTEXT context);
+extern void nvi_discovery_stop(void);
+/* asks for an active rescan now, returns immediately */
+extern void nvi_discovery_refresh(void);
+
+/* never blocks on the discovery thread, never null */
+extern nvi_stream_snapshot nvi_discovery_snapshot(void);
+
+/* called from the discovery thread whenever the directory changed */
+extern void nvi_discovery_add_callback(nvi_discovery_changed_t callback, void *param);
+extern void nvi_discovery_remove_callback(nvi_discovery_changed_t callback, void *param);
@@ -0,0 +1,274 @@
+#include "nvi-frame-hash.h"
+#include "nvi-frame-pool.h"
+#include <algorithm>
+#include <string.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define NVI_HASH_SSE42 1
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define NVI_HASH_ARM_CRC 1
+#include <arm_acle.h>
+#endif
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define NVI_TARGET_SSE42
+#else
+#define NVI_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+typedef uint64_t (*nvi_hash_block_fn)(const uint8_t *data, size_t stride, size_t bytes, size_t rows);
+
+static inline uint64_t nvi_load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t nvi_rotl64(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+/* two independent lanes keep the multiplier (or crc unit) busy and give
+ * 64 bits of result */
+static uint64_t nvi_hash_block_scalar(const uint8_t *data, size_t stride, size_t bytes, size_t rows)
+{
+	const uint64_t k = 0x9e3779b97f4a7c15ULL;
+	uint64_t a = k;
+	uint64_t b = ~k;
+	for (size_t y = 0; y < rows; y++) {
+		const uint8_t *row = data + y * stride;
+		size_t i = 0;
+		for (; i + 16 <= bytes; i += 16) {
+			a = (a ^ nvi_load64(row + i)) * k;
+			b = (b ^ nvi_load64(row + i + 8)) * k;
+			a ^= a >> 29;
+			b ^= b >> 29;
+		}
+		for (; i < bytes; i++)
+			a = (a ^ row[i]) * k;
+	}
+	return a ^ nvi_rotl64(b, 32);
+}
+
+#if defined(NVI_HASH_SSE42)
+NVI_TARGET_SSE42
+static uint64_t nvi_hash_block_sse42(const uint8_t *data, size_t stride, size_t bytes, size_t rows)
+{
+	uint64_t a = 0xffffffffu;
+	uint64_t b = 0x9e3779b9u;
+	for (size_t y = 0; y < rows; y++) {
+		const uint8_t *row = data + y * stride;
+		size_t i = 0;
+		for (; i + 16 <= bytes; i += 16) {
+			a = _mm_crc32_u64(a, nvi_load64(row + i));
+			b = _mm_crc32_u64(b, nvi_load64(row + i + 8));
+		}
+		for (; i < bytes; i++)
+			a = _mm_crc32_u8((uint32_t)a, row[i]);
+	}
+	return (a << 32) | (b & 0xffffffffu);
+}
+
+static bool nvi_cpu_has_sse42()
+{
+#ifdef _MSC_VER
+	int regs[4];
+	__cpuid(regs, 1);
+	return (regs[2] & (1 << 20)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(NVI_HASH_ARM_CRC)
+static uint64_t nvi_hash_block_arm_crc(const uint8_t *data, size_t stride, size_t bytes, size_t rows)
+{
+	uint32_t a = 0xffffffffu;
+	uint32_t b = 0x9e3779b9u;
+	for (size_t y = 0; y < rows; y++) {
+		const uint8_t *row = data + y * stride;
+		size_t i = 0;
+		for (; i + 16 <= bytes; i += 16) {
+			a = __crc32cd(a, nvi_load64(row + i));
+			b = __crc32cd(b, nvi_load64(row + i + 8));
+		}
+		for (; i < bytes; i++)
+			a = __crc32cb(a, row[i]);
+	}
+	return ((uint64_t)a << 32) | b;
+}
+#endif
+
+struct nvi_hash_kernel {
+	const char *isa;
+	nvi_hash_block_fn block;
+};
+
+static nvi_hash_kernel nvi_hash_kernel_select()
+{
+#if defined(NVI_HASH_SSE42)
+	if (nvi_cpu_has_sse42())
+		return {"sse4.2 crc32c", nvi_hash_block_sse42};
+#elif defined(NVI_HASH_ARM_CRC)
+	return {"armv8 crc32c", nvi_hash_block_arm_crc};
+#endif
+	return {"scalar", nvi_hash_block_scalar};
+}
+
+static const nvi_hash_kernel &nvi_hash_kernel_get()
+{
+	static const nvi_hash_kernel kernel = nvi_hash_kernel_select();
+	return kernel;
+}
+
+bool nvi_frame_hash_prepare(nvi_frame_hash *h, uint32_t format, uint32_t width, uint32_t height)
+{
+	if (h->format == format && h->width == width && h->height == height && h->plane_count)
+		return true;
+
+	h->format = format;
+	h->width = width;
+	h->height = height;
+	h->plane_count = nvi_frame_plane_heights(format, height, h->heights);
+	nvi_frame_hash_reset(h);
+	if (!h->plane_count || !width || !height)
+		return false;
+
+	uint32_t chroma_width = (width + 1) / 2;
+	h->row_bytes[0] = width;
+	h->tile_bytes[0] = NVI_HASH_TILE;
+	h->tile_rows[0] = NVI_HASH_TILE;
+	for (size_t i = 1; i < h->plane_count; i++) {
+		if (format == NVIPixel_NV12) {
+			h->row_bytes[i] = chroma_width * 2;
+			h->tile_bytes[i] = NVI_HASH_TILE;
+		} else {
+			h->row_bytes[i] = chroma_width;
+			h->tile_bytes[i] = NVI_HASH_TILE / 2;
+		}
+		h->tile_rows[i] = h->heights[i] == height ? NVI_HASH_TILE : NVI_HASH_TILE / 2;
+	}
+
+	h->tiles_x = (width + NVI_HASH_TILE - 1) / NVI_HASH_TILE;
+	h->tiles_y = (height + NVI_HASH_TILE - 1) / NVI_HASH_TILE;
+	h->tiles.assign(nvi_frame_hash_tile_count(h), 0);
+	h->previous.assign(nvi_frame_hash_tile_count(h), 0);
+	return true;
+}
+
+void nvi_frame_hash_reset(nvi_frame_hash *h)
+{
+	h->has_current = false;
+	h->has_previous = false;
+	h->has_sample = false;
+}
+
+bool nvi_frame_hash_sample(nvi_frame_hash *h, const uint8_t *const *planes, const uint32_t *strides)
+{
+	if (!h->plane_count)
+		return true;
+
+	/* one strided block per plane, NVI_HASH_SAMPLE_ROWS times fewer bytes
+	 * than the tiles */
+	nvi_hash_block_fn block = nvi_hash_kernel_get().block;
+	uint64_t sample = 0;
+	for (size_t p = 0; p < h->plane_count; p++) {
+		size_t rows = (h->heights[p] + NVI_HASH_SAMPLE_ROWS - 1) / NVI_HASH_SAMPLE_ROWS;
+		uint64_t hash = block(planes[p], (size_t)strides[p] * NVI_HASH_SAMPLE_ROWS, h->row_bytes[p], rows);
+		sample = (sample ^ hash) * 0x100000001b3ULL;
+	}
+
+	bool changed = !h->has_sample || sample != h->sample;
+	h->sample = sample;
+	h->has_sample = true;
+	return changed;
+}
+
+void nvi_frame_hash_update(nvi_frame_hash *h, const uint8_t *const *planes, const uint32_t *strides)
+{
+	if (!h->plane_count)
+		return;
+
+	if (h->has_current) {
+		h->tiles.swap(h->previous);
+		memcpy(h->previous_planes, h->planes, sizeof(h->planes));
+		h->has_previous = true;
+	}
+	h->has_current = true;
+
+	nvi_hash_block_fn block = nvi_hash_kernel_get().block;
+	std::fill(h->tiles.begin(), h->tiles.end(), 0);
+	for (size_t p = 0; p < h->plane_count; p++) {
+		uint64_t plane = 0;
+		for (uint32_t ty = 0; ty < h->tiles_y; ty++) {
+			uint32_t y = ty * h->tile_rows[p];
+			if (y >= h->heights[p])
+				break;
+			uint32_t rows = h->heights[p] - y < h->tile_rows[p] ? h->heights[p] - y : h->tile_rows[p];
+			const uint8_t *line = planes[p] + (size_t)y * strides[p];
+
+			for (uint32_t tx = 0; tx < h->tiles_x; tx++) {
+				uint32_t x = tx * h->tile_bytes[p];
+				if (x >= h->row_bytes[p])
+					break;
+				uint32_t bytes = h->row_bytes[p] - x < h->tile_bytes[p] ? h->row_bytes[p] - x
+										: h->tile_bytes[p];
+				uint64_t hash = block(line + x, strides[p], bytes, rows);
+
+				uint64_t &tile = h->tiles[(size_t)ty * h->tiles_x + tx];
+				tile = nvi_rotl64(tile, 21) ^ hash;
+				plane = (plane ^ hash) * 0x100000001b3ULL;
+			}
+		}
+		h->planes[p] = plane;
+	}
+}
+
+size_t nvi_frame_hash_diff(const nvi_frame_hash *h, NVIUpdateRect *bounds)
+{
+	*bounds = {};
+	if (!h->has_current)
+		return 0;
+	if (!h->has_previous) {
+		bounds->width = h->width;
+		bounds->height = h->height;
+		return nvi_frame_hash_tile_count(h);
+	}
+
+	uint32_t min_x = UINT32_MAX, min_y = UINT32_MAX, max_x = 0, max_y = 0;
+	size_t changed = 0;
+	for (uint32_t ty = 0; ty < h->tiles_y; ty++) {
+		const uint64_t *now = h->tiles.data() + (size_t)ty * h->tiles_x;
+		const uint64_t *before = h->previous.data() + (size_t)ty * h->tiles_x;
+		for (uint32_t tx = 0; tx < h->tiles_x; tx++) {
+			if (now[tx] == before[tx])
+				continue;
+			changed++;
+			min_x = tx < min_x ? tx : min_x;
+			max_x = tx > max_x ? tx : max_x;
+			min_y = ty < min_y ? ty : min_y;
+			max_y = ty;
+		}
+	}
+	if (!changed)
+		return 0;
+
+	uint32_t right = (max_x + 1) * NVI_HASH_TILE;
+	uint32_t bottom = (max_y + 1) * NVI_HASH_TILE;
+	bounds->x = min_x * NVI_HASH_TILE;
+	bounds->y = min_y * NVI_HASH_TILE;
+	bounds->width = (right < h->width ? right : h->width) - bounds->x;
+	bounds->height = (bottom < h->height ? bottom : h->height) - bounds->y;
+	return changed;
+}
+
+const char *nvi_frame_hash_isa(void)
+{
+	return nvi_hash_kernel_get().isa;
+}
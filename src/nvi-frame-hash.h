@@ -0,0 +1,79 @@
+#pragma once
+#include <nvi/API.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* luma pixels per tile side, 64 matches the largest hevc ctu so a dirty
+ * rect never cuts through one */
+#define NVI_HASH_TILE 64
+/* rows between the ones the pre-hash samples; a change shorter than this
+ * can slip past it */
+#define NVI_HASH_SAMPLE_ROWS 8
+
+/* crc based hashes of every tile of a frame and of the frame before it;
+ * cheap, not collision proof. one instance per producer thread */
+struct nvi_frame_hash {
+	uint32_t format = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t tiles_x = 0;
+	uint32_t tiles_y = 0;
+
+	size_t plane_count = 0;
+	uint32_t row_bytes[MaxPixelPlanes] = {};
+	uint32_t heights[MaxPixelPlanes] = {};
+	/* the part of each plane a luma tile covers */
+	uint32_t tile_bytes[MaxPixelPlanes] = {};
+	uint32_t tile_rows[MaxPixelPlanes] = {};
+
+	/* one entry per tile with all planes folded in */
+	std::vector<uint64_t> tiles;
+	std::vector<uint64_t> previous;
+	bool has_current = false;
+	bool has_previous = false;
+	/* each plane's tiles folded together */
+	uint64_t planes[MaxPixelPlanes] = {};
+	uint64_t previous_planes[MaxPixelPlanes] = {};
+
+	/* every NVI_HASH_SAMPLE_ROWS-th row of each plane, checked before
+	 * paying for the tiles */
+	uint64_t sample = 0;
+	bool has_sample = false;
+};
+
+/* I420, 422P and NV12 only; a new layout forgets the previous frame */
+extern bool nvi_frame_hash_prepare(nvi_frame_hash *h, uint32_t format, uint32_t width, uint32_t height);
+
+/* the next diff has nothing to compare against and reports a full change */
+extern void nvi_frame_hash_reset(nvi_frame_hash *h);
+
+/* hashes a sparse subset of rows, true when it differs from the last call's
+ * or there was none; the tiles only need an update then */
+extern bool nvi_frame_hash_sample(nvi_frame_hash *h, const uint8_t *const *planes, const uint32_t *strides);
+
+extern void nvi_frame_hash_update(nvi_frame_hash *h, const uint8_t *const *planes, const uint32_t *strides);
+
+/* bounding box in pixels of the tiles that changed since the previous
+ * update, returns how many changed; empty box and 0 when none did */
+extern size_t nvi_frame_hash_diff(const nvi_frame_hash *h, NVIUpdateRect *bounds);
+
+/* the last update hashed the same as the one before, per plane */
+static inline bool nvi_frame_hash_unchanged(const nvi_frame_hash *h)
+{
+	if (!h->has_previous)
+		return false;
+	for (size_t i = 0; i < h->plane_count; i++) {
+		if (h->planes[i] != h->previous_planes[i])
+			return false;
+	}
+	return true;
+}
+
+static inline size_t nvi_frame_hash_tile_count(const nvi_frame_hash *h)
+{
+	return (size_t)h->tiles_x * h->tiles_y;
+}
+
+/* name of the hash kernel picked for this cpu, for the log */
+extern const char *nvi_frame_hash_isa(void);
@@ -0,0 +1,161 @@
+#include "nvi-frame-pool.h"
+#include "nvi-memory.h"
+#include <string.h>
+
+#define NVI_FRAME_ALIGN 64
+
+static inline uint32_t nvi_align(uint32_t value)
+{
+	return (value + NVI_FRAME_ALIGN - 1) & ~(uint32_t)(NVI_FRAME_ALIGN - 1);
+}
+
+bool nvi_frame_key::operator==(const nvi_frame_key &other) const
+{
+	return memcmp(this, &other, sizeof(nvi_frame_key)) == 0;
+}
+
+size_t nvi_frame_plane_heights(uint32_t format, uint32_t height, uint32_t heights[MaxPixelPlanes])
+{
+	switch (format) {
+	case NVIPixel_I420:
+		heights[0] = height;
+		heights[1] = heights[2] = (height + 1) / 2;
+		return 3;
+	case NVIPixel_422P:
+		heights[0] = heights[1] = heights[2] = height;
+		return 3;
+	case NVIPixel_NV12:
+		heights[0] = height;
+		heights[1] = (height + 1) / 2;
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+bool nvi_frame_key_init(nvi_frame_key *key, uint32_t format, uint32_t width, uint32_t height)
+{
+	memset(key, 0, sizeof(*key));
+	key->format = format;
+	key->width = width;
+	key->height = height;
+
+	switch (format) {
+	case NVIPixel_I420:
+	case NVIPixel_422P:
+		key->strides[0] = nvi_align(width);
+		key->strides[1] = key->strides[2] = nvi_align((width + 1) / 2);
+		return true;
+	case NVIPixel_NV12:
+		key->strides[0] = nvi_align(width);
+		key->strides[1] = nvi_align((width + 1) / 2 * 2);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static nvi_pool_frame *nvi_pool_frame_alloc(nvi_frame_pool *pool, bool transient)
+{
+	auto frame = (nvi_pool_frame *)bzalloc(sizeof(nvi_pool_frame));
+	frame->pool = pool;
+	frame->transient = transient;
+	frame->data = (uint8_t *)nvi_mem_alloc(pool->frame_size);
+	frame->plane_count = nvi_frame_plane_heights(pool->key.format, pool->key.height, frame->heights);
+
+	uint8_t *plane = frame->data;
+	for (size_t i = 0; i < frame->plane_count; i++) {
+		frame->planes[i] = plane;
+		frame->strides[i] = pool->key.strides[i];
+		plane += (size_t)frame->strides[i] * frame->heights[i];
+	}
+	return frame;
+}
+
+static void nvi_pool_frame_free(nvi_pool_frame *frame)
+{
+	nvi_mem_free(frame->data);
+	bfree(frame);
+}
+
+nvi_frame_pool *nvi_frame_pool_create(const nvi_frame_key *key, size_t count)
+{
+	uint32_t heights[MaxPixelPlanes] = {};
+	size_t planes = nvi_frame_plane_heights(key->format, key->height, heights);
+	if (!planes)
+		return nullptr;
+
+	auto pool = new nvi_frame_pool();
+	pool->key = *key;
+	for (size_t i = 0; i < planes; i++)
+		pool->frame_size += (size_t)key->strides[i] * heights[i];
+
+	pool->frames.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		nvi_pool_frame *frame = nvi_pool_frame_alloc(pool, false);
+		pool->frames.push_back(frame);
+		pool->free.enqueue(frame);
+	}
+	return pool;
+}
+
+void nvi_frame_pool_destroy(nvi_frame_pool *pool)
+{
+	if (!pool)
+		return;
+
+	for (auto frame : pool->frames)
+		nvi_pool_frame_free(frame);
+	delete pool;
+}
+
+nvi_pool_frame *nvi_frame_pool_acquire(nvi_frame_pool *pool)
+{
+	nvi_pool_frame *frame = nullptr;
+	if (pool->free.try_dequeue(frame)) {
+		pool->hits++;
+		return frame;
+	}
+
+	pool->misses++;
+	return nvi_pool_frame_alloc(pool, true);
+}
+
+void nvi_frame_pool_release(nvi_pool_frame *frame)
+{
+	if (!frame)
+		return;
+
+	if (frame->transient)
+		nvi_pool_frame_free(frame);
+	else
+		frame->pool->free.enqueue(frame);
+}
+
+void nvi_pool_frame_copy(nvi_pool_frame *frame, const uint8_t *const *planes, const uint32_t *strides)
+{
+	for (size_t i = 0; i < frame->plane_count; i++) {
+		const uint8_t *src = planes[i];
+		uint8_t *dst = frame->planes[i];
+		uint32_t rows = frame->heights[i];
+
+		if (strides[i] == frame->strides[i]) {
+			memcpy(dst, src, (size_t)strides[i] * rows);
+			continue;
+		}
+
+		size_t row_bytes = strides[i] < frame->strides[i] ? strides[i] : frame->strides[i];
+		for (uint32_t y = 0; y < rows; y++) {
+			memcpy(dst, src, row_bytes);
+			src += strides[i];
+			dst += frame->strides[i];
+		}
+	}
+}
+
+void nvi_frame_pool_log_stats(nvi_frame_pool *pool, const char *name)
+{
+	blog(LOG_INFO, "'%s': nvi frame pool %ux%u: %zu frames x %zu bytes, hits %llu, misses %llu", name,
+	     pool->key.width, pool->key.height, pool->frames.size(), pool->frame_size,
+	     (unsigned long long)pool->hits.load(), (unsigned long long)pool->misses.load());
+}
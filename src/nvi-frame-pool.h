@@ -0,0 +1,56 @@
+#pragma once
+#include <obs-module.h>
+#include <nvi/API.h>
+#include <atomic>
+#include <vector>
+#include "concurrentqueue.h"
+
+/* layout every frame of a pool shares, strides are the pool's own */
+struct nvi_frame_key {
+	uint32_t format;
+	uint32_t width;
+	uint32_t height;
+	uint32_t strides[MaxPixelPlanes];
+
+	bool operator==(const nvi_frame_key &other) const;
+	bool operator!=(const nvi_frame_key &other) const { return !(*this == other); }
+};
+
+struct nvi_frame_pool;
+
+struct nvi_pool_frame {
+	nvi_frame_pool *pool;
+	bool transient;
+	uint8_t *data;
+	uint8_t *planes[MaxPixelPlanes];
+	uint32_t strides[MaxPixelPlanes];
+	uint32_t heights[MaxPixelPlanes];
+	size_t plane_count;
+};
+
+struct nvi_frame_pool {
+	nvi_frame_key key;
+	size_t frame_size = 0;
+	std::vector<nvi_pool_frame *> frames;
+	moodycamel::ConcurrentQueue<nvi_pool_frame *> free;
+
+	std::atomic<uint64_t> hits{0};
+	std::atomic<uint64_t> misses{0};
+};
+
+/* returns the planes and their row counts of a NVI pixel format, 0 if unsupported */
+extern size_t nvi_frame_plane_heights(uint32_t format, uint32_t height, uint32_t heights[MaxPixelPlanes]);
+extern bool nvi_frame_key_init(nvi_frame_key *key, uint32_t format, uint32_t width, uint32_t height);
+
+extern nvi_frame_pool *nvi_frame_pool_create(const nvi_frame_key *key, size_t count);
+/* all frames must have been released */
+extern void nvi_frame_pool_destroy(nvi_frame_pool *pool);
+
+/* never fails, falls back to a one-off allocation and counts a miss */
+extern nvi_pool_frame *nvi_frame_pool_acquire(nvi_frame_pool *pool);
+extern void nvi_frame_pool_release(nvi_pool_frame *frame);
+
+/* copies the planes row by row into the frame's own strides */
+extern void nvi_pool_frame_copy(nvi_pool_frame *frame, const uint8_t *const *planes, const uint32_t *strides);
+
+extern void nvi_frame_pool_log_stats(nvi_frame_pool *pool, const char *name);
@@ -0,0 +1,155 @@
+#include "nvi-jitter-buffer.h"
+#include <stdio.h>
+
+void nvi_jitter_buffer_configure(nvi_jitter_buffer *jb, uint32_t target_ms, size_t min_depth, size_t max_depth)
+{
+	jb->target_ns = (uint64_t)target_ms * 1000000ULL;
+	jb->min_depth = min_depth;
+	jb->max_depth = max_depth > min_depth ? max_depth : min_depth;
+	if (!jb->max_depth)
+		jb->max_depth = 1;
+
+	while (jb->frames.size() > jb->max_depth) {
+		nvi_frame_pool_release(jb->frames.front().frame);
+		jb->frames.pop_front();
+		jb->dropped++;
+	}
+	jb->depth = jb->frames.size();
+}
+
+void nvi_jitter_buffer_flush(nvi_jitter_buffer *jb)
+{
+	for (auto &entry : jb->frames)
+		nvi_frame_pool_release(entry.frame);
+	jb->frames.clear();
+	jb->primed = false;
+	jb->last_due = 0;
+	jb->depth = 0;
+}
+
+static void nvi_jitter_buffer_release_last(nvi_jitter_buffer *jb)
+{
+	nvi_frame_pool_release(jb->last.frame);
+	jb->last = {};
+}
+
+void nvi_jitter_buffer_free(nvi_jitter_buffer *jb)
+{
+	nvi_jitter_buffer_flush(jb);
+	nvi_jitter_buffer_release_last(jb);
+	nvi_frame_pool_destroy(jb->pool);
+	jb->pool = nullptr;
+}
+
+/* the pool follows the stream's format and is sized to the deepest setting,
+ * plus the frame on screen and the one being filled */
+static bool nvi_jitter_buffer_prepare_pool(nvi_jitter_buffer *jb, const obs_source_frame *frame,
+					   uint32_t nvi_format)
+{
+	nvi_frame_key key;
+	if (!nvi_frame_key_init(&key, nvi_format, frame->width, frame->height))
+		return false;
+
+	if (jb->pool && jb->pool->key == key && jb->pool->frames.size() >= jb->max_depth + 2)
+		return true;
+
+	nvi_jitter_buffer_flush(jb);
+	nvi_jitter_buffer_release_last(jb);
+	nvi_frame_pool_destroy(jb->pool);
+	jb->pool = nvi_frame_pool_create(&key, jb->max_depth + 2);
+	return jb->pool != nullptr;
+}
+
+void nvi_jitter_buffer_push(nvi_jitter_buffer *jb, const obs_source_frame *frame, uint32_t nvi_format,
+			    uint32_t fps_num, uint32_t fps_den, uint64_t now)
+{
+	if (!nvi_jitter_buffer_prepare_pool(jb, frame, nvi_format))
+		return;
+
+	uint64_t due = frame->timestamp + jb->target_ns;
+	if (due <= now)
+		jb->late++;
+
+	/* the stream clock relocked behind us, start over rather than reorder */
+	if (!jb->frames.empty() && due < jb->frames.back().due)
+		nvi_jitter_buffer_flush(jb);
+
+	if (jb->frames.size() >= jb->max_depth) {
+		nvi_frame_pool_release(jb->frames.front().frame);
+		jb->frames.pop_front();
+		jb->dropped++;
+	}
+
+	nvi_jitter_entry entry;
+	entry.frame = nvi_frame_pool_acquire(jb->pool);
+	nvi_pool_frame_copy(entry.frame, frame->data, frame->linesize);
+	entry.out = *frame;
+	for (size_t i = 0; i < entry.frame->plane_count; i++) {
+		entry.out.data[i] = entry.frame->planes[i];
+		entry.out.linesize[i] = entry.frame->strides[i];
+	}
+	entry.out.timestamp = due;
+	entry.due = due;
+	jb->frames.push_back(entry);
+
+	if (fps_num && fps_den)
+		jb->interval_ns = (uint64_t)fps_den * 1000000000ULL / fps_num;
+	jb->depth = jb->frames.size();
+}
+
+uint64_t nvi_jitter_buffer_next_due(const nvi_jitter_buffer *jb)
+{
+	if (jb->frames.empty() || (!jb->primed && jb->frames.size() < jb->min_depth))
+		return UINT64_MAX;
+	return jb->frames.front().due;
+}
+
+void nvi_jitter_buffer_play(nvi_jitter_buffer *jb, obs_source_t *source, uint64_t now)
+{
+	if (!jb->primed) {
+		if (jb->frames.empty() || jb->frames.size() < jb->min_depth)
+			return;
+		jb->primed = true;
+	}
+
+	nvi_jitter_entry entry;
+	bool have = false;
+	while (!jb->frames.empty() && jb->frames.front().due <= now) {
+		if (have) {
+			nvi_frame_pool_release(entry.frame);
+			jb->dropped++;
+		}
+		entry = jb->frames.front();
+		jb->frames.pop_front();
+		have = true;
+	}
+	if (!have)
+		return;
+
+	/* obs keeps showing the previous frame across a gap in the stream */
+	if (jb->last_due && jb->interval_ns && entry.due > jb->last_due + jb->interval_ns * 3 / 2)
+		jb->duplicated += (entry.due - jb->last_due + jb->interval_ns / 2) / jb->interval_ns - 1;
+	jb->last_due = entry.due;
+
+	obs_source_output_video(source, &entry.out);
+	nvi_jitter_buffer_release_last(jb);
+	jb->last = entry;
+	jb->played++;
+
+	/* ran dry: wait for min_depth frames again before resuming */
+	if (jb->frames.empty() && jb->min_depth)
+		jb->primed = false;
+	jb->depth = jb->frames.size();
+}
+
+const obs_source_frame *nvi_jitter_buffer_last(const nvi_jitter_buffer *jb)
+{
+	return jb->last.frame ? &jb->last.out : nullptr;
+}
+
+void nvi_jitter_buffer_describe(const nvi_jitter_buffer *jb, char *text, size_t size)
+{
+	snprintf(text, size, "Depth %zu, played %llu, late %llu, dropped %llu, duplicated %llu", jb->depth.load(),
+		 (unsigned long long)jb->played.load(), (unsigned long long)jb->late.load(),
+		 (unsigned long long)jb->dropped.load(), (unsigned long long)jb->duplicated.load());
+}
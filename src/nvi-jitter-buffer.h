@@ -0,0 +1,60 @@
+#pragma once
+#include <obs-module.h>
+#include <NVI/API.h>
+#include <atomic>
+#include <deque>
+#include "nvi-frame-pool.h"
+
+enum nvi_latency_mode {
+	NVI_LATENCY_NORMAL = 0,
+	NVI_LATENCY_ULTRA_LOW = 1,
+	NVI_LATENCY_BUFFERED = 2,
+};
+
+struct nvi_jitter_entry {
+	nvi_pool_frame *frame;
+	obs_source_frame out;
+	uint64_t due;
+};
+
+/* holds copies of received frames until their stream time plus a target
+ * latency; only the receive thread touches it, the counters are for the UI */
+struct nvi_jitter_buffer {
+	uint64_t target_ns = 0;
+	size_t min_depth = 0;
+	size_t max_depth = 1;
+
+	nvi_frame_pool *pool = nullptr;
+	std::deque<nvi_jitter_entry> frames;
+	/* the frame on screen, kept so signal loss can reuse it */
+	nvi_jitter_entry last = {};
+	bool primed = false;
+	uint64_t interval_ns = 0;
+	uint64_t last_due = 0;
+
+	std::atomic<size_t> depth{0};
+	std::atomic<uint64_t> played{0};
+	std::atomic<uint64_t> late{0};
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> duplicated{0};
+};
+
+extern void nvi_jitter_buffer_configure(nvi_jitter_buffer *jb, uint32_t target_ms, size_t min_depth,
+					size_t max_depth);
+extern void nvi_jitter_buffer_flush(nvi_jitter_buffer *jb);
+extern void nvi_jitter_buffer_free(nvi_jitter_buffer *jb);
+
+/* copies the frame, its timestamp must already be on the os_gettime_ns base */
+extern void nvi_jitter_buffer_push(nvi_jitter_buffer *jb, const obs_source_frame *frame, uint32_t nvi_format,
+				   uint32_t fps_num, uint32_t fps_den, uint64_t now);
+
+/* UINT64_MAX when nothing is queued */
+extern uint64_t nvi_jitter_buffer_next_due(const nvi_jitter_buffer *jb);
+
+/* outputs the newest frame that is due, older due frames count as dropped */
+extern void nvi_jitter_buffer_play(nvi_jitter_buffer *jb, obs_source_t *source, uint64_t now);
+
+/* null before the first frame played */
+extern const obs_source_frame *nvi_jitter_buffer_last(const nvi_jitter_buffer *jb);
+
+extern void nvi_jitter_buffer_describe(const nvi_jitter_buffer *jb, char *text, size_t size);
@@ -0,0 +1,43 @@
+#include "nvi-memory.h"
+#include <obs-module.h>
+#include <atomic>
+#include <stdint.h>
+
+struct nvi_mem_header {
+	void *base;
+	size_t size;
+};
+
+static std::atomic<size_t> nvi_mem_total{0};
+
+void *nvi_mem_alloc(size_t size)
+{
+	size_t total = size + sizeof(nvi_mem_header) + NVI_CACHE_LINE - 1;
+	auto base = (uint8_t *)bmalloc(total);
+	if (!base)
+		return nullptr;
+
+	uintptr_t aligned = ((uintptr_t)(base + sizeof(nvi_mem_header)) + NVI_CACHE_LINE - 1) &
+			    ~(uintptr_t)(NVI_CACHE_LINE - 1);
+	auto header = (nvi_mem_header *)aligned - 1;
+	header->base = base;
+	header->size = size;
+
+	nvi_mem_total += size;
+	return (void *)aligned;
+}
+
+void nvi_mem_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	auto header = (nvi_mem_header *)ptr - 1;
+	nvi_mem_total -= header->size;
+	bfree(header->base);
+}
+
+size_t nvi_mem_usage(void)
+{
+	return nvi_mem_total.load();
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+
+#define NVI_CACHE_LINE 64
+
+/* cache-line aligned allocations counted towards the plugin's footprint */
+extern void *nvi_mem_alloc(size_t size);
+extern void nvi_mem_free(void *ptr);
+
+/* bytes currently held through nvi_mem_alloc */
+extern size_t nvi_mem_usage(void);
@@ -1,61 +1,351 @@
 #include <obs-module.h>
+#include <util/platform.h>
+#include <util/util_uint64.h>
 #include "obs-nvi.h"
-#include <chrono>
+#include "nvi-send-queue.h"
+#include "nvi-send-bench.h"
+#include "nvi-frame-hash.h"
+#include "nvi-audio-convert.h"
+#include "nvi-memory.h"
 #include <qmessagebox.h>
+#include <string.h>
 
 struct nvi_output {
-	const char *nvi_name;
+	obs_output_t *output;
+	char *nvi_name;
 
 	bool started;
 	NVI_SENDER sender;
+	nvi_send_queue *queue;
+	nvi_frame_pool *video_pool;
+	int queue_depth;
+	nvi_drop_policy drop_policy;
 
 	uint32_t frame_width;
 	uint32_t frame_height;
 	video_format frame_format;
 	double video_framerate;
+	uint32_t fps_num;
+	uint32_t fps_den;
+
+	/* video and audio ticks count from the same os_gettime_ns origin */
+	uint64_t clock_base;
 
 	size_t audio_channels;
 	uint32_t audio_samplerate;
 	audio_format audiofmt;
-	uint64_t tick_value; 
-	uint8_t audio_buffer[4 * 1920000 * 12];
+	int audio_depth;
+	bool audio_dither;
+	nvi_dither dither;
+	uint64_t tick_value;
+	bool tick_valid;
+	uint8_t *audio_buffer;
+	size_t audio_buffer_size;
+
+	/* codec settings from the properties, geometry is filled in on start */
+	NVIVideoCodecParam video_preset;
+	NVIAudioCodecParam audio_preset;
+	bool slice_auto;
+	nvi_send_timing video_timing;
+
+	/* change detection, 0 percent turns it off */
+	int dirty_threshold;
+	nvi_frame_hash *hash;
+	NVIUpdateRect dirty_rect;
+	uint64_t dirty_frames;
+	uint64_t dirty_partial;
+	uint64_t dirty_unchanged;
+	uint64_t dirty_full;
+	double dirty_changed_sum;
+	double dirty_signalled_sum;
+
+	/* repeats of a static canvas are skipped, one still goes out within
+	 * the receivers' stall window so they don't call the stream lost */
+	bool suppress_duplicates;
+	int keepalive_ms;
+	uint64_t keepalive_ns;
+	uint64_t last_video_sent;
+	uint64_t video_frames;
+	uint64_t duplicates_suppressed;
+
+	/* encoded variant: obs encoder packets go out as they are */
+	uint32_t video_codec;
+	uint32_t video_pixel_format;
+	uint8_t *video_header;
+	size_t video_header_size;
+	uint32_t audio_codec;
+	uint8_t aac_profile;
+	uint8_t aac_freq_index;
+	uint8_t aac_channels;
+	uint8_t *packet_buffer;
+	size_t packet_buffer_size;
+	uint64_t packets_sent;
+	uint64_t packets_failed;
 };
 
 
-template<class T> void PlanarToPackedFloat(T **planars, float *packed, int sampleCountPerChan, int noChan)
-{
-	T max_value = std::numeric_limits<T>::max();
-	for (int i = 0; i < sampleCountPerChan; i++) {
-		for (int ch = 0; ch < noChan; ch++) {
-			if (std::is_floating_point<T>::value) {
-				packed[i * noChan + ch] = float(planars[ch][i]);
-			} else {
-				packed[i * noChan + ch] = float(planars[ch][i]) / float(max_value);
-			}
-		}
-	}
-}
 const char *nvi_output_getname(void *data)
 {
 	UNUSED_PARAMETER(data);
 	return "NVI Output";
 }
 
+static bool nvi_output_slice_benchmark(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(property);
+
+	auto o = (struct nvi_output *)data;
+	NVIVideoCodecParam base = o ? o->video_preset : NVIVideoCodecParam{};
+	if (!base.codec)
+		base.codec = NVICodec_HF;
+	if (nvi_send_bench_start(&base))
+		blog(LOG_INFO, "nvi slice benchmark started, results follow in the log");
+	else
+		blog(LOG_INFO, "nvi slice benchmark is already running");
+	return false;
+}
+
 obs_properties_t *nvi_output_getproperties(void *data)
 {
-	UNUSED_PARAMETER(data);
 
 	obs_properties_t *props = obs_properties_create();
 	obs_properties_set_flags(props, OBS_PROPERTIES_DEFER_UPDATE);
 
 	obs_properties_add_text(props, "nvi_name", "NVI Output", OBS_TEXT_DEFAULT);
 
+	obs_property_t *p = obs_properties_add_int(props, "queue_depth", "Send Queue Depth", 0, 16, 1);
+	obs_property_set_long_description(p, "Frames buffered between OBS and the NVI sender thread, 0 sends on the OBS thread");
+
+	p = obs_properties_add_list(props, "drop_policy", "When Queue Is Full", OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Drop Oldest", NVI_DROP_OLDEST);
+	obs_property_list_add_int(p, "Drop Newest", NVI_DROP_NEWEST);
+
+	p = obs_properties_add_list(props, "audio_depth", "Audio Bit Depth", OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "32-bit Float", 32);
+	obs_property_list_add_int(p, "24-bit PCM", 24);
+	obs_property_list_add_int(p, "16-bit PCM", 16);
+
+	obs_properties_add_bool(props, "audio_dither", "TPDF Dither (16/24-bit)");
+
+	p = obs_properties_add_list(props, "video_codec", "Video Codec", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "HF", NVICodec_HF);
+	obs_property_list_add_int(p, "HEVC", NVICodec_HEVC);
+	obs_property_list_add_int(p, "AVC", NVICodec_AVC);
+	obs_property_list_add_int(p, "JPEG-XS", NVICodec_JPEGXS);
+
+	p = obs_properties_add_int(props, "video_profile", "Profile", 0, 255, 1);
+	obs_property_set_long_description(p, "Codec specific profile value, 0 lets the encoder choose");
+	p = obs_properties_add_int(props, "video_gop", "GOP (frames)", 0, 1000, 1);
+	obs_property_set_long_description(p, "0 lets the encoder choose");
+	obs_properties_add_int(props, "video_avg_bitrate", "Average Bitrate (kbps)", 0, 2000000, 100);
+	obs_properties_add_int(props, "video_max_bitrate", "Maximum Bitrate (kbps)", 0, 2000000, 100);
+	p = obs_properties_add_int(props, "video_vbv", "VBV Buffer (kbit)", 0, 65535, 100);
+	obs_property_set_long_description(p, "Smaller buffers lower latency at the cost of quality on busy scenes");
+	p = obs_properties_add_int(props, "video_quality", "Quality", 0, 51, 1);
+	obs_property_set_long_description(p, "H.264/H.265 only, 0 lets the encoder choose, usually 18-28");
+
+	p = obs_properties_add_list(props, "video_slice_mode", "Slice Mode", OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Encoder Default", NVISliceMode_CodecCase);
+	obs_property_list_add_int(p, "Multiple Slices", NVISliceMode_MultiSlice);
+	obs_property_list_add_int(p, "Encoder per Slice", NVISliceMode_MultiEncoder);
+	obs_property_list_add_int(p, "Parallel UHD (Encoder per Slice, In Order)",
+				  NVISliceMode_MultiEncoder | NVISliceMode_InOrder);
+	p = obs_properties_add_int(props, "video_slice_count", "Slice Count", 0, 64, 1);
+	obs_property_set_long_description(p, "0 sizes it to the host's physical cores");
+	p = obs_properties_add_int_slider(props, "dirty_threshold", "Dirty Rect Threshold (%)", 0, 100, 1);
+	obs_property_set_long_description(p, "Frames changing more than this share of the picture go out as full "
+					     "updates, 0 turns change detection off");
+
+	obs_properties_add_bool(props, "suppress_duplicates", "Skip Repeated Frames");
+	p = obs_properties_add_int(props, "keepalive_ms", "Repeat Keep-alive", 20, 5000, 10);
+	obs_property_int_set_suffix(p, " ms");
+	obs_property_set_long_description(p, "An unchanged picture is still sent this often. Receivers that call a "
+					     "stream lost after a shorter gap, the NVI Source does after 3 frame "
+					     "intervals, run their signal loss handling while the picture is static: "
+					     "set them to Hold Last Frame or keep this below their gap");
+
+	p = obs_properties_add_button2(props, "slice_benchmark", "Benchmark Slice Counts", nvi_output_slice_benchmark,
+				       data);
+	obs_property_set_long_description(p, "Encodes synthetic 1080p and 2160p pictures for a few seconds and logs "
+					     "the frame times. Meanwhile a stream named 'TEST STREAM - OBS Slice "
+					     "Benchmark' is briefly visible to NVI receivers on the network");
+
+	p = obs_properties_add_list(props, "audio_codec", "Audio Codec", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "LPCM", NVICodec_LPCM);
+	obs_property_list_add_int(p, "AAC", NVICodec_AAC);
+	obs_property_list_add_int(p, "Opus", NVICodec_OPUS);
+	p = obs_properties_add_int(props, "audio_bitrate", "Audio Bitrate (kbps)", 0, 1024, 16);
+	obs_property_set_long_description(p, "AAC and Opus only");
+
 	return props;
 }
 
 
 void nvi_output_getdefaults(obs_data_t *settings)
 {
+	obs_data_set_default_int(settings, "queue_depth", 3);
+	obs_data_set_default_int(settings, "drop_policy", NVI_DROP_OLDEST);
+	obs_data_set_default_int(settings, "audio_depth", 32);
+	obs_data_set_default_bool(settings, "audio_dither", true);
+	obs_data_set_default_int(settings, "video_codec", NVICodec_HF);
+	obs_data_set_default_int(settings, "video_slice_mode", NVISliceMode_CodecCase);
+	obs_data_set_default_int(settings, "video_slice_count", 0);
+	obs_data_set_default_int(settings, "audio_codec", NVICodec_LPCM);
+	/* hashing costs the video thread a pass over every changing frame, opt in */
+	obs_data_set_default_int(settings, "dirty_threshold", 0);
+	obs_data_set_default_bool(settings, "suppress_duplicates", false);
+	obs_data_set_default_int(settings, "keepalive_ms", 1000);
+	obs_data_set_default_int(settings, "audio_bitrate", 192);
+}
+
+static const char *nvi_output_codec_name(uint32_t codec)
+{
+	switch (codec) {
+	case NVICodec_HF:
+		return "hf";
+	case NVICodec_HEVC:
+		return "hevc";
+	case NVICodec_AVC:
+		return "avc";
+	case NVICodec_JPEGXS:
+		return "jpeg-xs";
+	case NVICodec_LPCM:
+		return "lpcm";
+	case NVICodec_AAC:
+		return "aac";
+	case NVICodec_OPUS:
+		return "opus";
+	default:
+		return "default";
+	}
+}
+
+static uint32_t nvi_output_pixel_format(video_format format)
+{
+	switch (format) {
+	case VIDEO_FORMAT_I420:
+		return NVIPixel_I420;
+	case VIDEO_FORMAT_I422:
+		return NVIPixel_422P;
+	case VIDEO_FORMAT_NV12:
+		return NVIPixel_NV12;
+	default:
+		return NVIPixel_Unspecific;
+	}
+}
+
+/* the pool survives stop/start and is only rebuilt when the canvas changes */
+static void nvi_output_prepare_pool(struct nvi_output *o, size_t depth)
+{
+	nvi_frame_key key;
+	if (!o->frame_width ||
+	    !nvi_frame_key_init(&key, nvi_output_pixel_format(o->frame_format), o->frame_width, o->frame_height)) {
+		nvi_frame_pool_destroy(o->video_pool);
+		o->video_pool = nullptr;
+		return;
+	}
+
+	size_t count = nvi_send_queue_slots(depth);
+	if (o->video_pool && o->video_pool->key == key && o->video_pool->frames.size() == count)
+		return;
+
+	nvi_frame_pool_destroy(o->video_pool);
+	o->video_pool = nvi_frame_pool_create(&key, count);
+}
+
+static uint64_t nvi_output_ticks(struct nvi_output *o, uint64_t timestamp, uint64_t freq)
+{
+	uint64_t elapsed = timestamp > o->clock_base ? timestamp - o->clock_base : 0;
+	return util_mul_div64(elapsed, freq, 1000000000ULL);
+}
+
+/* packed float staging, narrowing to 16/24-bit happens in place */
+static bool nvi_output_reserve_audio(struct nvi_output *o, size_t frames)
+{
+	size_t size = frames * o->audio_channels * sizeof(float);
+	if (o->audio_buffer && o->audio_buffer_size >= size)
+		return true;
+
+	nvi_mem_free(o->audio_buffer);
+	o->audio_buffer = (uint8_t *)nvi_mem_alloc(size);
+	o->audio_buffer_size = o->audio_buffer ? size : 0;
+	return o->audio_buffer != nullptr;
+}
+
+/* one encoder per physical core, less one left for obs, and no slice
+ * thinner than 128 rows */
+static uint16_t nvi_output_auto_slices(uint32_t height)
+{
+	int cores = os_get_physical_cores() - 1;
+	uint32_t count = cores > 1 ? (uint32_t)cores : 1;
+	uint32_t rows = height / 128;
+	if (count > rows)
+		count = rows ? rows : 1;
+	return (uint16_t)(count < 16 ? count : 16);
+}
+
+/* must run before the first frame, the sender opens its encoders on it */
+static bool nvi_output_apply_preset(struct nvi_output *o, bool video, bool audio)
+{
+	NVIVideoCodecParam *v = &o->video_preset;
+	v->width = o->frame_width;
+	v->height = o->frame_height;
+	v->frame_rate_num = o->fps_num;
+	v->frame_rate_den = o->fps_den;
+	v->format = nvi_output_pixel_format(o->frame_format);
+	v->colorspace.primary = NVIPrimary_BT709;
+	v->colorspace.transfer = NVITransfer_BT709;
+	v->colorspace.matrix = NVIMatrix_BT709;
+	v->colorspace.range = NVIRange_Limited;
+	if (o->slice_auto)
+		v->slice_count = v->slice_mode == NVISliceMode_CodecCase ? 0 : nvi_output_auto_slices(v->height);
+
+	NVIAudioCodecParam *a = &o->audio_preset;
+	a->sample_rate = o->audio_samplerate;
+	a->channels = (uint16_t)o->audio_channels;
+	a->depth = o->audio_depth == 16 ? NVIWaveBit_16 : (o->audio_depth == 24 ? NVIWaveBit_24 : NVIWaveBit_F32);
+
+	NVISendPresetParam preset{};
+	preset.video = video ? v : nullptr;
+	preset.audio = audio ? a : nullptr;
+	int32_t err = NVISendPreset(o->sender, &preset);
+	if (err < 0) {
+		blog(LOG_WARNING, "'%s': nvi sender preset failed (%d): video %s, audio %s", o->nvi_name, err,
+		     nvi_output_codec_name(v->codec), nvi_output_codec_name(a->codec));
+		return false;
+	}
+
+	blog(LOG_INFO,
+	     "'%s': nvi sender preset video %s profile %u gop %u, %u/%u kbps, vbv %u, quality %u, "
+	     "slice mode %u x%u; audio %s %u kbps",
+	     o->nvi_name, nvi_output_codec_name(v->codec), v->profile, v->gop, v->avg_bitrate, v->max_bitrate,
+	     v->vbv, v->quality, v->slice_mode, v->slice_count, nvi_output_codec_name(a->codec), a->bitrate);
+
+	o->dirty_frames = 0;
+	o->dirty_partial = 0;
+	o->dirty_unchanged = 0;
+	o->dirty_full = 0;
+	o->dirty_changed_sum = 0.0;
+	o->dirty_signalled_sum = 0.0;
+	o->last_video_sent = 0;
+	o->video_frames = 0;
+	o->duplicates_suppressed = 0;
+	/* half an interval of slack so timestamp jitter can't push a
+	 * keep-alive one frame later */
+	uint64_t interval = o->fps_num ? util_mul_div64(1000000000ULL, o->fps_den, o->fps_num) : 0;
+	uint64_t keepalive = (uint64_t)o->keepalive_ms * 1000000ULL;
+	o->keepalive_ns = keepalive > interval / 2 ? keepalive - interval / 2 : 0;
+	if (o->hash)
+		nvi_frame_hash_reset(o->hash);
+
+	o->video_timing = {};
+	o->video_timing.budget_ns = o->fps_num ? util_mul_div64(1000000000ULL, o->fps_den, o->fps_num) : 0;
+	o->video_timing.slices = v->slice_count ? v->slice_count : 1;
+	return true;
 }
 
 bool nvi_output_start(void *data)
@@ -81,6 +371,9 @@ bool nvi_output_start(void *data)
 		o->frame_width = width;
 		o->frame_height = height;
 		o->video_framerate = video_output_get_frame_rate(video);
+		auto info = video_output_get_info(video);
+		o->fps_num = info ? info->fps_num : 30;
+		o->fps_den = info ? info->fps_den : 1;
 		flags |= OBS_OUTPUT_VIDEO;
 	}
 
@@ -90,20 +383,48 @@ bool nvi_output_start(void *data)
 		auto info = audio_output_get_info(audio);
 		if (info)
 			o->audiofmt = info->format;
+		nvi_output_reserve_audio(o, AUDIO_OUTPUT_FRAMES);
+		nvi_dither_init(&o->dither, (uint32_t)os_gettime_ns());
+		blog(LOG_INFO, "'%s': nvi audio sent as %s, conversion uses %s kernels", o->nvi_name,
+		     o->audio_depth == 16 ? "16-bit pcm" : (o->audio_depth == 24 ? "24-bit pcm" : "32-bit float"),
+		     nvi_audio_convert_isa());
 		flags |= OBS_OUTPUT_AUDIO;
 	}
 
+	o->clock_base = os_gettime_ns();
+	o->tick_valid = false;
+
 	NVISendAllocParam param{};
 	param.alias = "OBS";
 	o->sender = NVISendAlloc(g_nvi_ctx, &param);
-	
+
+	if (o->sender && !nvi_output_apply_preset(o, video != nullptr, audio != nullptr)) {
+		NVISendFree(o->sender);
+		o->sender = nullptr;
+		QMessageBox::information(nullptr, "Error", "NVI sender preset rejected, check the codec settings",
+					 QMessageBox::Ok);
+		return false;
+	}
 
 	if (o->sender) {
+		if (o->queue_depth > 0) {
+			nvi_output_prepare_pool(o, (size_t)o->queue_depth);
+			o->queue = nvi_send_queue_create(o->sender, (size_t)o->queue_depth, o->drop_policy,
+							 o->video_pool, &o->video_timing);
+		}
+
 		o->started = obs_output_begin_data_capture(main_out, flags);
 		if (o->started) {
 			blog(LOG_INFO, "'%s': nvi output started", o->nvi_name);
+			blog(LOG_INFO,
+			     "'%s': nvi output memory: instance %zu bytes, audio staging %zu bytes, "
+			     "video pool %zu bytes, plugin total %zu bytes",
+			     o->nvi_name, sizeof(struct nvi_output), o->audio_buffer_size,
+			     o->video_pool ? o->video_pool->frames.size() * o->video_pool->frame_size : 0,
+			     nvi_mem_usage());
 		} else {
-
+			nvi_send_queue_destroy(o->queue);
+			o->queue = nullptr;
 			QMessageBox::information(nullptr, "Error", "NVI Output capture start failed",
 						 QMessageBox::Ok);
 		}
@@ -121,11 +442,35 @@ void nvi_output_stop(void *data, uint64_t ts)
 	o->started = false;
 	obs_output_end_data_capture(main_out);
 
-	
+	if (o->queue) {
+		nvi_send_queue_log_stats(o->queue, o->nvi_name);
+		nvi_send_queue_destroy(o->queue);
+		o->queue = nullptr;
+	}
+	if (o->video_pool)
+		nvi_frame_pool_log_stats(o->video_pool, o->nvi_name);
+	nvi_send_timing_log(&o->video_timing, o->nvi_name);
+	if (o->dirty_frames)
+		blog(LOG_INFO,
+		     "'%s': nvi change detection (%s): changed area avg %.1f%%, signalled %.1f%%; "
+		     "%llu partial, %llu unchanged sent whole, %llu full over the %d%% threshold",
+		     o->nvi_name, nvi_frame_hash_isa(), o->dirty_changed_sum * 100.0 / o->dirty_frames,
+		     o->dirty_signalled_sum * 100.0 / o->dirty_frames, (unsigned long long)o->dirty_partial,
+		     (unsigned long long)o->dirty_unchanged, (unsigned long long)o->dirty_full, o->dirty_threshold);
+	if (o->suppress_duplicates)
+		blog(LOG_INFO, "'%s': nvi skipped %llu of %llu video frames as repeats, keep-alive %d ms",
+		     o->nvi_name, (unsigned long long)o->duplicates_suppressed, (unsigned long long)o->video_frames,
+		     o->keepalive_ms);
+	if (o->sender) {
+		NVISendFree(o->sender);
+		o->sender = nullptr;
+	}
 
 	o->frame_width = 0;
 	o->frame_height = 0;
 	o->video_framerate = 0.0;
+	o->fps_num = 0;
+	o->fps_den = 0;
 
 	o->audio_channels = 0;
 	o->audio_samplerate = 0;
@@ -133,11 +478,44 @@ void nvi_output_stop(void *data, uint64_t ts)
 
 void nvi_output_update(void *data, obs_data_t *settings)
 {
+	auto o = (struct nvi_output *)data;
+
+	/* picked up on the next start */
+	o->queue_depth = (int)obs_data_get_int(settings, "queue_depth");
+	o->drop_policy = (nvi_drop_policy)obs_data_get_int(settings, "drop_policy");
+	o->audio_depth = (int)obs_data_get_int(settings, "audio_depth");
+	o->audio_dither = obs_data_get_bool(settings, "audio_dither");
+	bfree(o->nvi_name);
+	o->nvi_name = bstrdup(obs_data_get_string(settings, "nvi_name"));
+
+	NVIVideoCodecParam *v = &o->video_preset;
+	*v = {};
+	v->codec = (uint32_t)obs_data_get_int(settings, "video_codec");
+	v->profile = (uint32_t)obs_data_get_int(settings, "video_profile");
+	v->gop = (uint32_t)obs_data_get_int(settings, "video_gop");
+	v->avg_bitrate = (uint32_t)obs_data_get_int(settings, "video_avg_bitrate");
+	v->max_bitrate = (uint32_t)obs_data_get_int(settings, "video_max_bitrate");
+	if (v->max_bitrate && v->max_bitrate < v->avg_bitrate)
+		v->max_bitrate = v->avg_bitrate;
+	v->vbv = (uint16_t)obs_data_get_int(settings, "video_vbv");
+	v->quality = (uint8_t)obs_data_get_int(settings, "video_quality");
+	v->slice_mode = (uint16_t)obs_data_get_int(settings, "video_slice_mode");
+	v->slice_count = (uint16_t)obs_data_get_int(settings, "video_slice_count");
+	o->slice_auto = v->slice_count == 0;
+	o->dirty_threshold = (int)obs_data_get_int(settings, "dirty_threshold");
+	o->suppress_duplicates = obs_data_get_bool(settings, "suppress_duplicates");
+	o->keepalive_ms = (int)obs_data_get_int(settings, "keepalive_ms");
+
+	NVIAudioCodecParam *a = &o->audio_preset;
+	*a = {};
+	a->codec = (uint32_t)obs_data_get_int(settings, "audio_codec");
+	a->bitrate = a->codec == NVICodec_LPCM ? 0 : (uint32_t)obs_data_get_int(settings, "audio_bitrate");
 }
 
 void *nvi_output_create(obs_data_t *settings, obs_output_t *output)
 {
 	auto o = (struct nvi_output *)bzalloc(sizeof(nvi_output));
+	o->output = output;
 	nvi_output_update(o, settings);
 	return o;
 }
@@ -145,9 +523,45 @@ void *nvi_output_create(obs_data_t *settings, obs_output_t *output)
 void nvi_output_destroy(void *data)
 {
 	auto o = (struct nvi_output *)data;
+	nvi_frame_pool_destroy(o->video_pool);
+	nvi_mem_free(o->audio_buffer);
+	nvi_mem_free(o->video_header);
+	nvi_mem_free(o->packet_buffer);
+	delete o->hash;
+	bfree(o->nvi_name);
 	bfree(o);
 }
 
+/* tiles that hash the same as last frame's are left out of the update rect,
+ * null asks the sender for a full update. Stream.h gives an empty rect no
+ * meaning, so an unchanged frame goes out whole; skipping repeats is what
+ * suppress_duplicates is for */
+/* `unchanged` frames skip the diff, their tiles may not have been hashed */
+static NVIUpdateRect *nvi_output_dirty_rect(struct nvi_output *o, bool unchanged)
+{
+	o->dirty_rect = {};
+	size_t changed = unchanged ? 0 : nvi_frame_hash_diff(o->hash, &o->dirty_rect);
+	double area = (double)o->dirty_rect.width * o->dirty_rect.height /
+		      ((double)o->frame_width * o->frame_height);
+
+	o->dirty_frames++;
+	o->dirty_changed_sum += (double)changed / nvi_frame_hash_tile_count(o->hash);
+	if (!changed) {
+		o->dirty_unchanged++;
+		o->dirty_signalled_sum += 1.0;
+		return nullptr;
+	}
+	if (area * 100.0 > o->dirty_threshold) {
+		o->dirty_full++;
+		o->dirty_signalled_sum += 1.0;
+		return nullptr;
+	}
+
+	o->dirty_partial++;
+	o->dirty_signalled_sum += area;
+	return &o->dirty_rect;
+}
+
 void nvi_output_video(void *data, struct video_data *frame)
 {
 	auto o = (struct nvi_output *)data;
@@ -162,20 +576,21 @@ void nvi_output_video(void *data, struct video_data *frame)
 	image.side.bytes = nullptr;
 	image.side.size = 0;
 	image.updated = nullptr;
-	image.info.codec = NVICodec_AVC;
+	/* the codec the sender will encode these frames with */
+	image.info.codec = o->video_preset.codec;
 	image.info.width = width;
 	image.info.height = height;
-	image.info.frame_rate_num = 30;
-	image.info.frame_rate_den = 1;
+	image.info.frame_rate_num = o->fps_num;
+	image.info.frame_rate_den = o->fps_den;
 	image.info.rotation = 0u;
 	image.info.colorspace.primary = NVIPrimary_BT709;
 	image.info.colorspace.transfer = NVITransfer_BT709;
 	image.info.colorspace.matrix = NVIMatrix_BT709;
 	image.info.colorspace.range = NVIRange_Limited;
-	image.info.tick.value = 0u;
+	image.info.tick.value = nvi_output_ticks(o, frame->timestamp, 90000);
 	image.info.tick.freq_num = 1u;
 	image.info.tick.freq_den = 90000u;
-	image.info.time = frame->timestamp;
+	image.info.time = (NVIDateTime)(frame->timestamp / 1000);
 	if (o->frame_format == VIDEO_FORMAT_I420) {
 		image.buffer.format = NVIPixel_I420;
 		image.buffer.strides[0] = frame->linesize[0];
@@ -201,15 +616,43 @@ void nvi_output_video(void *data, struct video_data *frame)
 		image.buffer.planes[1] = frame->data[1];
 	} else {
 		blog(LOG_INFO, "unsupport video format");
+		return;
 	}
-	image.info.time = std::chrono::duration_cast<std::chrono::microseconds>(
-				  std::chrono::steady_clock::now().time_since_epoch())
-				  .count();
 	image.buffer.type = NVIBuffer_HOST;
-	//blog(LOG_INFO, "send video");
-	NVISendVideo(o->sender, &image);
 
-	
+	o->video_frames++;
+	bool hashed = false;
+	bool unchanged = false;
+	if (o->dirty_threshold > 0 || o->suppress_duplicates) {
+		if (!o->hash)
+			o->hash = new nvi_frame_hash();
+		hashed = nvi_frame_hash_prepare(o->hash, image.buffer.format, width, height);
+		/* this runs on the video thread: a static canvas only pays for the
+		 * sampled rows, the tiles are hashed once those change */
+		if (hashed && nvi_frame_hash_sample(o->hash, image.buffer.planes, image.buffer.strides)) {
+			nvi_frame_hash_update(o->hash, image.buffer.planes, image.buffer.strides);
+			unchanged = nvi_frame_hash_unchanged(o->hash);
+		} else {
+			unchanged = hashed;
+		}
+	}
+	if (unchanged && o->suppress_duplicates && frame->timestamp < o->last_video_sent + o->keepalive_ns) {
+		o->duplicates_suppressed++;
+		return;
+	}
+	if (hashed && o->dirty_threshold > 0)
+		image.updated = nvi_output_dirty_rect(o, unchanged);
+
+	/* a frame that never went out breaks the chain, the next one is full */
+	bool sent;
+	if (o->queue)
+		sent = nvi_send_queue_push_video(o->queue, &image);
+	else
+		sent = nvi_send_video_timed(o->sender, &image, &o->video_timing) >= 0;
+	if (!sent && o->hash)
+		nvi_frame_hash_reset(o->hash);
+	else if (sent)
+		o->last_video_sent = frame->timestamp;
 }
 
 void nvi_output_audio(void *data, struct audio_data *frame)
@@ -219,42 +662,353 @@ void nvi_output_audio(void *data, struct audio_data *frame)
 	if (!o->started || !o->audio_samplerate || !o->audio_channels)
 		return;
 
+	if (!nvi_output_reserve_audio(o, frame->frames))
+		return;
+
 	NVIAudioWaveFrame wave{};
-	wave.info.depth = NVIWaveBit_F32;
-	wave.buffer.align = 4;
 	if (o->audiofmt == AUDIO_FORMAT_FLOAT_PLANAR) {
-		PlanarToPackedFloat<float>((float **)frame->data, (float *)o->audio_buffer, (int)frame->frames,
-					   (int)o->audio_channels);
-		
+		nvi_planar_to_packed_float(NVI_SAMPLE_F32, frame->data, (float *)o->audio_buffer, frame->frames,
+					   o->audio_channels);
 	} else if (o->audiofmt == AUDIO_FORMAT_16BIT_PLANAR) {
-		PlanarToPackedFloat<int16_t>((int16_t **)frame->data, (float *)o->audio_buffer, (int)frame->frames,
-					     (int)o->audio_channels);
+		nvi_planar_to_packed_float(NVI_SAMPLE_S16, frame->data, (float *)o->audio_buffer, frame->frames,
+					   o->audio_channels);
 	} else if (o->audiofmt == AUDIO_FORMAT_U8BIT_PLANAR) {
-		PlanarToPackedFloat<uint8_t>((uint8_t **)frame->data, (float *)o->audio_buffer, (int)frame->frames,
-					     (int)o->audio_channels);
+		nvi_planar_to_packed_float(NVI_SAMPLE_U8, frame->data, (float *)o->audio_buffer, frame->frames,
+					   o->audio_channels);
 	} else {
 		blog(LOG_INFO, "unsupport audio format: %u", o->audiofmt);
 		return;
 	}
-	
+
+	/* narrowed in place, the packed samples only ever shrink */
+	size_t samples = (size_t)frame->frames * o->audio_channels;
+	nvi_dither *dither = o->audio_dither ? &o->dither : nullptr;
+	if (o->audio_depth == 16) {
+		nvi_packed_float_to_s16((float *)o->audio_buffer, o->audio_buffer, samples, dither);
+		wave.info.depth = NVIWaveBit_16;
+		wave.buffer.align = 2;
+	} else if (o->audio_depth == 24) {
+		nvi_packed_float_to_s24((float *)o->audio_buffer, o->audio_buffer, samples, dither);
+		wave.info.depth = NVIWaveBit_24;
+		wave.buffer.align = 3;
+	} else {
+		wave.info.depth = NVIWaveBit_F32;
+		wave.buffer.align = 4;
+	}
+
+	/* the tick counts samples so it stays contiguous, it is only re-seeded
+	 * from the timestamp when obs skips or repeats audio */
+	uint64_t expected = nvi_output_ticks(o, frame->timestamp, o->audio_samplerate);
+	uint64_t slack = frame->frames;
+	if (!o->tick_valid || expected > o->tick_value + slack || expected + slack < o->tick_value) {
+		o->tick_value = expected;
+		o->tick_valid = true;
+	}
+
 	wave.info.codec = NVICodec_LPCM;
 	wave.info.sample_rate = o->audio_samplerate;
 	wave.info.channels =(uint16_t) o->audio_channels;
 	wave.info.tick.value = o->tick_value;
 	wave.info.tick.freq_num = 1u;
 	wave.info.tick.freq_den = wave.info.sample_rate;
-	wave.info.time = frame->timestamp;
+	wave.info.time = (NVIDateTime)(frame->timestamp / 1000);
 	wave.buffer.samples = frame->frames;
 	wave.buffer.data = o->audio_buffer;
-	wave.buffer.size = frame->frames * wave.info.channels * 4;
+	wave.buffer.size = samples * wave.buffer.align;
 	o->tick_value += wave.buffer.samples;
 
 	
 	
 	//blog(LOG_INFO, "send audio");
-	NVISendAudio(o->sender, &wave);
+	if (o->queue)
+		nvi_send_queue_push_audio(o->queue, &wave);
+	else
+		NVISendAudio(o->sender, &wave);
+}
+
+int nvi_output_dropped_frames(void *data)
+{
+	auto o = (struct nvi_output *)data;
+	return o->queue ? (int)o->queue->video.drops.load() : 0;
 }
 
+static uint32_t nvi_output_codec(const char *codec)
+{
+	if (!codec)
+		return 0;
+	if (strcmp(codec, "h264") == 0)
+		return NVICodec_AVC;
+	if (strcmp(codec, "hevc") == 0)
+		return NVICodec_HEVC;
+	if (strcmp(codec, "aac") == 0)
+		return NVICodec_AAC;
+	if (strcmp(codec, "opus") == 0)
+		return NVICodec_OPUS;
+	return 0;
+}
+
+static uint8_t *nvi_output_reserve_packet(struct nvi_output *o, size_t size)
+{
+	if (o->packet_buffer && o->packet_buffer_size >= size)
+		return o->packet_buffer;
+
+	nvi_mem_free(o->packet_buffer);
+	o->packet_buffer = (uint8_t *)nvi_mem_alloc(size);
+	o->packet_buffer_size = o->packet_buffer ? size : 0;
+	return o->packet_buffer;
+}
+
+/* obs aac encoders emit raw frames with the AudioSpecificConfig in extra
+ * data, a receiver only sees packets so each one gets an adts header */
+static bool nvi_output_parse_aac_config(struct nvi_output *o, const uint8_t *config, size_t size)
+{
+	if (size < 2)
+		return false;
+
+	uint8_t object = config[0] >> 3;
+	uint8_t freq_index = (uint8_t)(((config[0] & 0x07) << 1) | (config[1] >> 7));
+	uint8_t channels = (config[1] >> 3) & 0x0f;
+	/* adts has two bits of profile, so main, lc, ssr and ltp only */
+	if (!object || object > 4 || freq_index > 12 || !channels)
+		return false;
+
+	o->aac_profile = object - 1;
+	o->aac_freq_index = freq_index;
+	o->aac_channels = channels;
+	return true;
+}
+
+static void nvi_output_write_adts(struct nvi_output *o, uint8_t *header, size_t payload)
+{
+	size_t length = payload + 7;
+	header[0] = 0xff;
+	header[1] = 0xf1;
+	header[2] = (uint8_t)((o->aac_profile << 6) | (o->aac_freq_index << 2) | (o->aac_channels >> 2));
+	header[3] = (uint8_t)(((o->aac_channels & 0x03) << 6) | ((length >> 11) & 0x03));
+	header[4] = (uint8_t)((length >> 3) & 0xff);
+	header[5] = (uint8_t)(((length & 0x07) << 5) | 0x1f);
+	header[6] = 0xfc;
+}
+
+obs_properties_t *nvi_output_encoded_getproperties(void *data)
+{
+	UNUSED_PARAMETER(data);
+
+	obs_properties_t *props = obs_properties_create();
+	obs_properties_add_text(props, "nvi_name", "NVI Output", OBS_TEXT_DEFAULT);
+	return props;
+}
+
+const char *nvi_output_encoded_getname(void *data)
+{
+	UNUSED_PARAMETER(data);
+	return "NVI Output (Encoded)";
+}
+
+static bool nvi_output_encoded_prepare_video(struct nvi_output *o, obs_encoder_t *encoder)
+{
+	const char *codec = obs_encoder_get_codec(encoder);
+	o->video_codec = nvi_output_codec(codec);
+	if (o->video_codec != NVICodec_AVC && o->video_codec != NVICodec_HEVC) {
+		blog(LOG_WARNING, "'%s': nvi can not carry '%s' video", o->nvi_name, codec ? codec : "");
+		obs_output_set_last_error(o->output, "NVI can only carry H.264 and HEVC video");
+		return false;
+	}
+
+	o->frame_width = obs_encoder_get_width(encoder);
+	o->frame_height = obs_encoder_get_height(encoder);
+	video_t *video = obs_encoder_video(encoder);
+	auto info = video ? video_output_get_info(video) : nullptr;
+	o->fps_num = info ? info->fps_num : 30;
+	o->fps_den = info ? info->fps_den : 1;
+	o->video_pixel_format = info ? nvi_output_pixel_format(info->format) : (uint32_t)NVIPixel_Unspecific;
+
+	uint8_t *header = nullptr;
+	size_t size = 0;
+	nvi_mem_free(o->video_header);
+	o->video_header = nullptr;
+	o->video_header_size = 0;
+	if (obs_encoder_get_extra_data(encoder, &header, &size) && size) {
+		o->video_header = (uint8_t *)nvi_mem_alloc(size);
+		if (o->video_header) {
+			memcpy(o->video_header, header, size);
+			o->video_header_size = size;
+		}
+	}
+	return true;
+}
+
+static bool nvi_output_encoded_prepare_audio(struct nvi_output *o, obs_encoder_t *encoder)
+{
+	const char *codec = obs_encoder_get_codec(encoder);
+	o->audio_codec = nvi_output_codec(codec);
+	if (o->audio_codec != NVICodec_AAC && o->audio_codec != NVICodec_OPUS) {
+		blog(LOG_WARNING, "'%s': nvi can not carry '%s' audio", o->nvi_name, codec ? codec : "");
+		obs_output_set_last_error(o->output, "NVI can only carry AAC and Opus audio");
+		return false;
+	}
+
+	o->audio_samplerate = obs_encoder_get_sample_rate(encoder);
+	audio_t *audio = obs_encoder_audio(encoder);
+	o->audio_channels = audio ? audio_output_get_channels(audio) : 2;
+	if (o->audio_codec != NVICodec_AAC)
+		return true;
+
+	uint8_t *config = nullptr;
+	size_t size = 0;
+	if (!obs_encoder_get_extra_data(encoder, &config, &size) || !nvi_output_parse_aac_config(o, config, size)) {
+		blog(LOG_WARNING, "'%s': unusable aac config from the encoder", o->nvi_name);
+		obs_output_set_last_error(o->output, "Unusable AAC config from the audio encoder");
+		return false;
+	}
+	return true;
+}
+
+bool nvi_output_encoded_start(void *data)
+{
+	auto o = (struct nvi_output *)data;
+
+	if (!obs_output_can_begin_data_capture(o->output, 0) || !obs_output_initialize_encoders(o->output, 0))
+		return false;
+
+	/* OBS_OUTPUT_AV: initialize_encoders has checked both are set */
+	obs_encoder_t *video = obs_output_get_video_encoder(o->output);
+	obs_encoder_t *audio = obs_output_get_audio_encoder(o->output, 0);
+	if (!nvi_output_encoded_prepare_video(o, video) || !nvi_output_encoded_prepare_audio(o, audio))
+		return false;
+
+	NVISendAllocParam param{};
+	param.alias = "OBS Encoded";
+	o->sender = NVISendAlloc(g_nvi_ctx, &param);
+	if (!o->sender) {
+		obs_output_set_last_error(o->output, "NVI sender create failed");
+		return false;
+	}
+
+	o->packets_sent = 0;
+	o->packets_failed = 0;
+	o->started = obs_output_begin_data_capture(o->output, 0);
+	if (!o->started) {
+		NVISendFree(o->sender);
+		o->sender = nullptr;
+		obs_output_set_last_error(o->output, "NVI Output capture start failed");
+		return false;
+	}
+
+	blog(LOG_INFO, "'%s': nvi encoded output started, video %s %ux%u, audio %s", o->nvi_name,
+	     obs_encoder_get_codec(video), o->frame_width, o->frame_height, obs_encoder_get_codec(audio));
+	return true;
+}
+
+void nvi_output_encoded_stop(void *data, uint64_t ts)
+{
+	UNUSED_PARAMETER(ts);
+	auto o = (struct nvi_output *)data;
+
+	o->started = false;
+	obs_output_end_data_capture(o->output);
+
+	if (o->sender) {
+		blog(LOG_INFO, "'%s': nvi encoded output sent %llu packets, %llu failed", o->nvi_name,
+		     (unsigned long long)o->packets_sent, (unsigned long long)o->packets_failed);
+		NVISendFree(o->sender);
+		o->sender = nullptr;
+	}
+
+	o->frame_width = 0;
+	o->frame_height = 0;
+	o->fps_num = 0;
+	o->fps_den = 0;
+	o->audio_channels = 0;
+	o->audio_samplerate = 0;
+}
+
+static int32_t nvi_output_send_video_packet(struct nvi_output *o, struct encoder_packet *packet)
+{
+	NVIVideoEncodedPacket encoded{};
+	encoded.info.codec = o->video_codec;
+	encoded.info.width = o->frame_width;
+	encoded.info.height = o->frame_height;
+	encoded.info.frame_rate_num = o->fps_num;
+	encoded.info.frame_rate_den = o->fps_den;
+	encoded.info.frame_kind = packet->keyframe ? NVIFrameKind_Intra : NVIFrameKind_Delta;
+	encoded.info.frame_format = NVIFrame_Progressive;
+	encoded.info.colorspace.primary = NVIPrimary_BT709;
+	encoded.info.colorspace.transfer = NVITransfer_BT709;
+	encoded.info.colorspace.matrix = NVIMatrix_BT709;
+	encoded.info.colorspace.range = NVIRange_Limited;
+	encoded.info.tick.value = packet->pts > 0 ? (uint64_t)packet->pts : 0;
+	encoded.info.tick.freq_num = (uint32_t)packet->timebase_num;
+	encoded.info.tick.freq_den = (uint32_t)packet->timebase_den;
+	encoded.info.time = (NVIDateTime)packet->sys_dts_usec;
+	encoded.slice_count = 1;
+	encoded.slice_number = 1;
+	encoded.pixel_format = o->video_pixel_format;
+
+	const uint8_t *bytes = packet->data;
+	size_t size = packet->size;
+	/* parameter sets ride on every keyframe so a receiver can join at any */
+	if (packet->keyframe && o->video_header_size) {
+		uint8_t *buffer = nvi_output_reserve_packet(o, o->video_header_size + size);
+		if (!buffer)
+			return -1;
+		memcpy(buffer, o->video_header, o->video_header_size);
+		memcpy(buffer + o->video_header_size, bytes, size);
+		bytes = buffer;
+		size += o->video_header_size;
+	}
+	encoded.buffer.bytes = bytes;
+	encoded.buffer.size = size;
+	return NVISendVideoEncoded(o->sender, &encoded);
+}
+
+static int32_t nvi_output_send_audio_packet(struct nvi_output *o, struct encoder_packet *packet)
+{
+	NVIAudioEncodedPacket encoded{};
+	encoded.info.codec = o->audio_codec;
+	encoded.info.sample_rate = o->audio_samplerate;
+	encoded.info.channels = (uint16_t)o->audio_channels;
+	encoded.info.tick.value = packet->pts > 0 ? (uint64_t)packet->pts : 0;
+	encoded.info.tick.freq_num = (uint32_t)packet->timebase_num;
+	encoded.info.tick.freq_den = (uint32_t)packet->timebase_den;
+	encoded.info.time = (NVIDateTime)packet->sys_dts_usec;
+
+	const uint8_t *bytes = packet->data;
+	size_t size = packet->size;
+	if (o->audio_codec == NVICodec_AAC) {
+		uint8_t *buffer = nvi_output_reserve_packet(o, size + 7);
+		if (!buffer)
+			return -1;
+		nvi_output_write_adts(o, buffer, size);
+		memcpy(buffer + 7, bytes, size);
+		bytes = buffer;
+		size += 7;
+	}
+	encoded.buffer.bytes = bytes;
+	encoded.buffer.size = size;
+	return NVISendAudioEncoded(o->sender, &encoded);
+}
+
+/* one encode feeds both the stream and nvi, nothing here copies more than
+ * the headers the receiver needs */
+void nvi_output_encoded_packet(void *data, struct encoder_packet *packet)
+{
+	auto o = (struct nvi_output *)data;
+
+	if (!o->started || !packet)
+		return;
+
+	int32_t err;
+	if (packet->type == OBS_ENCODER_VIDEO)
+		err = o->video_codec ? nvi_output_send_video_packet(o, packet) : 0;
+	else
+		err = o->audio_codec ? nvi_output_send_audio_packet(o, packet) : 0;
+
+	if (err < 0)
+		o->packets_failed++;
+	else
+		o->packets_sent++;
+}
 
 struct obs_output_info create_nvi_output_info()
 {
@@ -271,6 +1025,28 @@ struct obs_output_info create_nvi_output_info()
 	nvi_output_info.stop = nvi_output_stop;
 	nvi_output_info.raw_video = nvi_output_video;
 	nvi_output_info.raw_audio = nvi_output_audio;
+	nvi_output_info.get_dropped_frames = nvi_output_dropped_frames;
+
+	return nvi_output_info;
+}
+
+struct obs_output_info create_nvi_encoded_output_info()
+{
+	struct obs_output_info nvi_output_info = {};
+	nvi_output_info.id = "nvi_output_encoded";
+	nvi_output_info.flags = OBS_OUTPUT_AV | OBS_OUTPUT_ENCODED;
+	nvi_output_info.encoded_video_codecs = "h264;hevc";
+	nvi_output_info.encoded_audio_codecs = "aac;opus";
+	nvi_output_info.get_name = nvi_output_encoded_getname;
+	nvi_output_info.get_properties = nvi_output_encoded_getproperties;
+	/* update is shared with the raw output and reads all of its settings */
+	nvi_output_info.get_defaults = nvi_output_getdefaults;
+	nvi_output_info.create = nvi_output_create;
+	nvi_output_info.destroy = nvi_output_destroy;
+	nvi_output_info.update = nvi_output_update;
+	nvi_output_info.start = nvi_output_encoded_start;
+	nvi_output_info.stop = nvi_output_encoded_stop;
+	nvi_output_info.encoded_packet = nvi_output_encoded_packet;
 
 	return nvi_output_info;
 }
@@ -0,0 +1,286 @@
+#include "nvi-recv-pool.h"
+#include "atomicops.h"
+#include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <stdio.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+/* poll period while some receiver is connected but nothing is ready; it
+ * backs off to an eighth of the time since the worker last had work, so a
+ * busy stream is picked up within a fraction of its frame interval and a
+ * stalled one costs a few wakeups a second */
+#define NVI_POOL_POLL_MIN_US 1000
+#define NVI_POOL_POLL_MAX_US 50000
+#define NVI_POOL_POLL_BACKOFF 8
+/* a task its owner has not reached for this long is fair game for others */
+#define NVI_POOL_STEAL_NS 4000000ULL
+#define NVI_POOL_LOAD_WINDOW_NS 1000000000ULL
+/* placement weight of a task that has not built up any load yet */
+#define NVI_POOL_TASK_COST_NS 1000000ULL
+
+struct nvi_recv_worker {
+	size_t index;
+	std::thread thread;
+	std::mutex lock;
+	std::vector<nvi_recv_task *> tasks;
+	moodycamel::spsc_sema::LightweightSemaphore wake;
+	std::atomic<uint64_t> load{0};
+};
+
+struct nvi_recv_pool {
+	std::vector<nvi_recv_worker *> workers;
+	std::atomic<bool> stopping{false};
+};
+
+static std::mutex pool_lock;
+static nvi_recv_pool *pool = nullptr;
+
+/* claiming happens under the worker's lock, so once detach has removed a
+ * task nobody can pick it up again; the step itself runs unlocked */
+static nvi_recv_task *nvi_recv_worker_claim(nvi_recv_worker *w, size_t i, bool starved_only, bool *claimed)
+{
+	std::lock_guard<std::mutex> guard(w->lock);
+	if (i >= w->tasks.size())
+		return nullptr;
+
+	nvi_recv_task *task = w->tasks[i];
+	if (starved_only && (!task->streaming.load(std::memory_order_relaxed) ||
+			     os_gettime_ns() - task->last_step.load(std::memory_order_relaxed) < NVI_POOL_STEAL_NS))
+		return task;
+
+	bool expected = false;
+	*claimed = task->claimed.compare_exchange_strong(expected, true, std::memory_order_acquire);
+	return task;
+}
+
+static nvi_recv_step nvi_recv_task_run(nvi_recv_task *task, size_t worker)
+{
+	uint64_t start = os_gettime_ns();
+	nvi_recv_step result = task->step(task->data);
+	uint64_t end = os_gettime_ns();
+
+	task->steps++;
+	task->busy_ns += end - start;
+	task->last_step = end;
+	task->streaming.store(result == NVI_STEP_POLLED || result == NVI_STEP_WORKED, std::memory_order_relaxed);
+	if (result == NVI_STEP_WORKED)
+		task->worked++;
+	if (worker != task->worker.load(std::memory_order_relaxed))
+		task->stolen++;
+
+	task->claimed.store(false, std::memory_order_release);
+	return result;
+}
+
+/* runs the starved tasks of other workers, their owner is stuck on a slow step */
+static bool nvi_recv_worker_steal(nvi_recv_worker *self)
+{
+	bool worked = false;
+
+	for (auto victim : pool->workers) {
+		if (victim == self)
+			continue;
+
+		for (size_t i = 0;; i++) {
+			bool claimed = false;
+			nvi_recv_task *task = nvi_recv_worker_claim(victim, i, true, &claimed);
+			if (!task)
+				break;
+			if (claimed)
+				worked |= nvi_recv_task_run(task, self->index) == NVI_STEP_WORKED;
+		}
+	}
+	return worked;
+}
+
+static void nvi_recv_worker_update_load(nvi_recv_worker *w)
+{
+	std::lock_guard<std::mutex> guard(w->lock);
+	uint64_t total = 0;
+	for (auto task : w->tasks) {
+		uint64_t busy = task->busy_ns.load();
+		task->load = busy - task->busy_mark;
+		task->busy_mark = busy;
+		total += task->load;
+	}
+	w->load = total;
+}
+
+static void nvi_recv_worker_thread(nvi_recv_worker *w)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "nvi-source: recv %zu", w->index);
+	os_set_thread_name(name);
+
+	uint64_t load_at = os_gettime_ns() + NVI_POOL_LOAD_WINDOW_NS;
+	uint64_t worked_at = os_gettime_ns();
+
+	while (!pool->stopping) {
+		bool worked = false;
+		bool polling = false;
+		uint64_t due = UINT64_MAX;
+
+		for (size_t i = 0;; i++) {
+			bool claimed = false;
+			nvi_recv_task *task = nvi_recv_worker_claim(w, i, false, &claimed);
+			if (!task)
+				break;
+			if (!claimed) {
+				/* a thief has it right now */
+				polling = true;
+				continue;
+			}
+			nvi_recv_step result = nvi_recv_task_run(task, w->index);
+			worked |= result == NVI_STEP_WORKED;
+			polling |= result != NVI_STEP_IDLE;
+			if (result == NVI_STEP_WAITING)
+				due = std::min(due, task->due.load(std::memory_order_relaxed));
+		}
+
+		uint64_t now = os_gettime_ns();
+		if (now >= load_at) {
+			nvi_recv_worker_update_load(w);
+			load_at = now + NVI_POOL_LOAD_WINDOW_NS;
+		}
+
+		if (worked || nvi_recv_worker_steal(w)) {
+			worked_at = now;
+			continue;
+		}
+
+		if (polling) {
+			uint64_t wait_us = (now - worked_at) / 1000 / NVI_POOL_POLL_BACKOFF;
+			wait_us = std::clamp<uint64_t>(wait_us, NVI_POOL_POLL_MIN_US, NVI_POOL_POLL_MAX_US);
+			/* a retry or concealment timer must not wait out the backoff */
+			if (due != UINT64_MAX)
+				wait_us = std::min(wait_us, due > now ? (due - now) / 1000 : 0);
+			if (w->wake.wait((std::int64_t)wait_us))
+				worked_at = os_gettime_ns();
+		} else {
+			/* every receiver idle: no wakeups until a command is posted */
+			w->wake.wait();
+		}
+	}
+}
+
+static nvi_recv_pool *nvi_recv_pool_start(void)
+{
+	size_t count = std::max<size_t>(1, std::thread::hardware_concurrency() / 2);
+
+	auto p = new nvi_recv_pool();
+	p->workers.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		auto w = new nvi_recv_worker();
+		w->index = i;
+		p->workers.push_back(w);
+	}
+
+	pool = p;
+	for (auto w : p->workers) {
+		w->thread = std::thread(nvi_recv_worker_thread, w);
+#ifdef WIN32
+		/* above normal only, dozens of sources must not starve the graphics thread */
+		SetThreadPriority(w->thread.native_handle(), THREAD_PRIORITY_ABOVE_NORMAL);
+#endif
+	}
+	blog(LOG_INFO, "nvi receive pool started with %zu workers", count);
+	return p;
+}
+
+void nvi_recv_pool_attach(nvi_recv_task *task)
+{
+	std::lock_guard<std::mutex> guard(pool_lock);
+	if (!pool)
+		nvi_recv_pool_start();
+
+	nvi_recv_worker *best = nullptr;
+	uint64_t best_cost = UINT64_MAX;
+	for (auto w : pool->workers) {
+		std::lock_guard<std::mutex> worker_guard(w->lock);
+		uint64_t cost = w->load + w->tasks.size() * NVI_POOL_TASK_COST_NS;
+		if (cost < best_cost) {
+			best = w;
+			best_cost = cost;
+		}
+	}
+
+	task->last_step = os_gettime_ns();
+	task->worker = best->index;
+	{
+		std::lock_guard<std::mutex> worker_guard(best->lock);
+		best->tasks.push_back(task);
+	}
+	best->wake.signal();
+}
+
+/* the workers are fixed once the pool is up and it only goes away at
+ * shutdown, after every source; a task with a worker index can reach its
+ * worker without pool_lock */
+void nvi_recv_pool_detach(nvi_recv_task *task)
+{
+	size_t index = task->worker;
+	if (index == SIZE_MAX)
+		return;
+
+	nvi_recv_worker *w = pool->workers[index];
+	{
+		std::lock_guard<std::mutex> worker_guard(w->lock);
+		w->tasks.erase(std::remove(w->tasks.begin(), w->tasks.end(), task), w->tasks.end());
+	}
+	/* a worker may still be in a slow step of it, wait without holding
+	 * anything other sources post through */
+	while (task->claimed.load(std::memory_order_acquire))
+		std::this_thread::yield();
+	task->worker = SIZE_MAX;
+}
+
+void nvi_recv_pool_wake(nvi_recv_task *task)
+{
+	size_t index = task->worker;
+	if (index != SIZE_MAX)
+		pool->workers[index]->wake.signal();
+}
+
+void nvi_recv_pool_describe(const nvi_recv_task *task, char *text, size_t size)
+{
+	size_t index = task->worker;
+	if (index == SIZE_MAX) {
+		snprintf(text, size, "Dedicated receive thread");
+		return;
+	}
+
+	uint64_t worker_load = 0;
+	{
+		std::lock_guard<std::mutex> guard(pool_lock);
+		if (pool && index < pool->workers.size())
+			worker_load = pool->workers[index]->load;
+	}
+	snprintf(text, size,
+		 "Pool worker %zu (%.1f%% busy), this source %.1f%% busy, steps %llu, worked %llu, stolen %llu", index,
+		 worker_load / 1e7, task->load.load() / 1e7, (unsigned long long)task->steps.load(),
+		 (unsigned long long)task->worked.load(), (unsigned long long)task->stolen.load());
+}
+
+void nvi_recv_pool_shutdown(void)
+{
+	std::lock_guard<std::mutex> guard(pool_lock);
+	if (!pool)
+		return;
+
+	pool->stopping = true;
+	for (auto w : pool->workers) {
+		w->wake.signal();
+		if (w->thread.joinable())
+			w->thread.join();
+		delete w;
+	}
+	delete pool;
+	pool = nullptr;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+enum nvi_recv_step {
+	NVI_STEP_IDLE,   /* nothing to poll until a command arrives */
+	NVI_STEP_WAITING, /* no receiver, polled only for a retry or concealment timer */
+	NVI_STEP_POLLED, /* polled, nothing was ready */
+	NVI_STEP_WORKED, /* handled a frame or a command */
+};
+
+/* a receiver multiplexed on the shared pool; step must not block, it is run
+ * by at most one worker at a time */
+struct nvi_recv_task {
+	nvi_recv_step (*step)(void *data);
+	void *data;
+
+	std::atomic<bool> claimed{false};
+	std::atomic<size_t> worker{SIZE_MAX};
+	std::atomic<uint64_t> last_step{0};
+	/* only tasks whose last step was polling a receiver are worth stealing */
+	std::atomic<bool> streaming{false};
+	/* set by a step returning NVI_STEP_WAITING: when its next timer is due */
+	std::atomic<uint64_t> due{UINT64_MAX};
+
+	std::atomic<uint64_t> steps{0};
+	std::atomic<uint64_t> worked{0};
+	std::atomic<uint64_t> busy_ns{0};
+	std::atomic<uint64_t> stolen{0};
+	/* busy ns over the last second, what placement balances on */
+	std::atomic<uint64_t> load{0};
+	uint64_t busy_mark = 0;
+};
+
+/* pins the task to the least loaded worker, starting the pool on first use */
+extern void nvi_recv_pool_attach(nvi_recv_task *task);
+/* returns once no worker is running the task any more */
+extern void nvi_recv_pool_detach(nvi_recv_task *task);
+/* ends the owning worker's wait so a queued command runs now */
+extern void nvi_recv_pool_wake(nvi_recv_task *task);
+
+extern void nvi_recv_pool_describe(const nvi_recv_task *task, char *text, size_t size);
+extern void nvi_recv_pool_shutdown(void);
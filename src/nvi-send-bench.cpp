@@ -0,0 +1,184 @@
+#include "nvi-send-bench.h"
+#include "nvi-send-queue.h"
+#include "nvi-memory.h"
+#include "obs-nvi.h"
+#include <obs-module.h>
+#include <util/platform.h>
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#define NVI_BENCH_FPS 50
+#define NVI_BENCH_FRAMES 150
+/* distinct pictures cycled through, so the encoder never sees a still */
+#define NVI_BENCH_PICTURES 4
+
+static std::mutex bench_mutex;
+static std::thread bench_thread;
+static std::atomic<bool> bench_running{false};
+static std::atomic<bool> bench_stopping{false};
+
+/* a moving gradient with grain, a flat picture would flatter the encoder */
+static void nvi_send_bench_fill(uint8_t *picture, uint32_t width, uint32_t height, uint32_t index)
+{
+	uint32_t seed = 0x9e3779b9u * (index + 1);
+	uint8_t *luma = picture;
+	for (uint32_t y = 0; y < height; y++) {
+		uint8_t *row = luma + (size_t)y * width;
+		for (uint32_t x = 0; x < width; x++) {
+			seed = seed * 1664525u + 1013904223u;
+			row[x] = (uint8_t)(x + y + index * 16 + (seed >> 27));
+		}
+	}
+
+	uint8_t *chroma = luma + (size_t)width * height;
+	size_t chroma_size = (size_t)(width / 2) * (height / 2);
+	for (size_t i = 0; i < chroma_size; i++) {
+		chroma[i] = (uint8_t)(128 + ((i + index * 8) & 0x3f) - 32);
+		chroma[chroma_size + i] = (uint8_t)(128 - ((i / width + index * 4) & 0x3f) + 32);
+	}
+}
+
+static bool nvi_send_bench_one(const char *alias, const NVIVideoCodecParam *base, uint8_t *const *pictures,
+			       uint32_t width, uint32_t height, uint16_t slices, nvi_send_timing *timing)
+{
+	NVISendAllocParam param{};
+	param.alias = alias;
+	NVI_SENDER sender = NVISendAlloc(g_nvi_ctx, &param);
+	if (!sender)
+		return false;
+
+	NVIVideoCodecParam video = *base;
+	video.width = width;
+	video.height = height;
+	video.frame_rate_num = NVI_BENCH_FPS;
+	video.frame_rate_den = 1;
+	video.format = NVIPixel_I420;
+	video.slice_mode = NVISliceMode_MultiEncoder | NVISliceMode_InOrder;
+	video.slice_count = slices;
+	video.colorspace.primary = NVIPrimary_BT709;
+	video.colorspace.transfer = NVITransfer_BT709;
+	video.colorspace.matrix = NVIMatrix_BT709;
+	video.colorspace.range = NVIRange_Limited;
+
+	NVISendPresetParam preset{};
+	preset.video = &video;
+	if (NVISendPreset(sender, &preset) < 0) {
+		NVISendFree(sender);
+		return false;
+	}
+
+	*timing = {};
+	timing->budget_ns = 1000000000ULL / NVI_BENCH_FPS;
+	timing->slices = slices;
+
+	NVIVideoImageFrame image{};
+	image.info.codec = video.codec;
+	image.info.width = width;
+	image.info.height = height;
+	image.info.frame_rate_num = NVI_BENCH_FPS;
+	image.info.frame_rate_den = 1;
+	image.info.colorspace = video.colorspace;
+	image.info.tick.freq_num = 1u;
+	image.info.tick.freq_den = NVI_BENCH_FPS;
+	image.buffer.type = NVIBuffer_HOST;
+	image.buffer.format = NVIPixel_I420;
+	image.buffer.strides[0] = width;
+	image.buffer.strides[1] = width / 2;
+	image.buffer.strides[2] = width / 2;
+
+	for (uint32_t i = 0; i < NVI_BENCH_FRAMES && !bench_stopping; i++) {
+		uint8_t *picture = pictures[i % NVI_BENCH_PICTURES];
+		image.buffer.planes[0] = picture;
+		image.buffer.planes[1] = picture + (size_t)width * height;
+		image.buffer.planes[2] = image.buffer.planes[1] + (size_t)(width / 2) * (height / 2);
+		image.info.tick.value = i;
+		image.info.time = (NVIDateTime)(os_gettime_ns() / 1000);
+		nvi_send_video_timed(sender, &image, timing);
+	}
+
+	NVISendFree(sender);
+	return true;
+}
+
+static void nvi_send_bench_thread(NVIVideoCodecParam base)
+{
+	os_set_thread_name("nvi-output: slice benchmark");
+
+	/* the senders are discoverable while they run: say what they are, and
+	 * never take over the alias of a real stream */
+	char alias[64];
+	snprintf(alias, sizeof(alias), "TEST STREAM - OBS Slice Benchmark %08x", (uint32_t)os_gettime_ns());
+
+	static const uint32_t sizes[][2] = {{1920, 1080}, {3840, 2160}};
+	static const uint16_t slice_counts[] = {1, 2, 4, 8};
+
+	blog(LOG_INFO, "nvi slice benchmark: %d physical cores, %d logical, sending as '%s'",
+	     os_get_physical_cores(), os_get_logical_cores(), alias);
+
+	for (auto &size : sizes) {
+		uint32_t width = size[0];
+		uint32_t height = size[1];
+		size_t picture_size = (size_t)width * height * 3 / 2;
+
+		uint8_t *pictures[NVI_BENCH_PICTURES] = {};
+		bool ready = true;
+		for (uint32_t i = 0; i < NVI_BENCH_PICTURES && ready; i++) {
+			pictures[i] = (uint8_t *)nvi_mem_alloc(picture_size);
+			ready = pictures[i] != nullptr;
+			if (ready)
+				nvi_send_bench_fill(pictures[i], width, height, i);
+		}
+
+		uint16_t fewest = 0;
+		for (uint16_t slices : slice_counts) {
+			if (!ready || bench_stopping)
+				break;
+
+			nvi_send_timing timing;
+			if (!nvi_send_bench_one(alias, &base, pictures, width, height, slices, &timing)) {
+				blog(LOG_WARNING, "nvi slice benchmark: %ux%u with %u slices was rejected by the sender",
+				     width, height, slices);
+				continue;
+			}
+			nvi_send_timing_log(&timing, height > 1080 ? "bench 2160p" : "bench 1080p");
+			if (!fewest && timing.frames && !timing.over_budget)
+				fewest = slices;
+		}
+
+		if (fewest)
+			blog(LOG_INFO, "nvi slice benchmark: %ux%u holds %dp from %u slices", width, height,
+			     NVI_BENCH_FPS, fewest);
+		else
+			blog(LOG_INFO, "nvi slice benchmark: %ux%u did not hold %dp at any slice count", width,
+			     height, NVI_BENCH_FPS);
+
+		for (uint8_t *picture : pictures)
+			nvi_mem_free(picture);
+	}
+
+	bench_running = false;
+}
+
+bool nvi_send_bench_start(const NVIVideoCodecParam *base)
+{
+	std::lock_guard<std::mutex> lock(bench_mutex);
+	if (bench_running)
+		return false;
+	if (bench_thread.joinable())
+		bench_thread.join();
+
+	bench_stopping = false;
+	bench_running = true;
+	bench_thread = std::thread(nvi_send_bench_thread, *base);
+	return true;
+}
+
+void nvi_send_bench_stop(void)
+{
+	std::lock_guard<std::mutex> lock(bench_mutex);
+	bench_stopping = true;
+	if (bench_thread.joinable())
+		bench_thread.join();
+}
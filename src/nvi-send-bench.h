@@ -0,0 +1,11 @@
+#pragma once
+#include <nvi/API.h>
+
+/* encodes synthetic 1080p and 2160p frames with 1, 2, 4 and 8 encoder
+ * slices on its own thread and logs the frame times against a 50p budget;
+ * the senders are visible on the network under a unique test alias while
+ * it runs. returns false when a run is already going */
+extern bool nvi_send_bench_start(const NVIVideoCodecParam *base);
+
+/* stops a running benchmark and waits for its thread */
+extern void nvi_send_bench_stop(void);
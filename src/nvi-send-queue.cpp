@@ -0,0 +1,281 @@
+#include "nvi-send-queue.h"
+#include "nvi-memory.h"
+#include <util/platform.h>
+#include <util/threading.h>
+#include <algorithm>
+#include <string.h>
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+static void nvi_send_item_reserve(nvi_send_item *item, size_t size)
+{
+	if (item->capacity >= size)
+		return;
+	nvi_mem_free(item->data);
+	item->data = (uint8_t *)nvi_mem_alloc(size);
+	item->capacity = size;
+}
+
+static void nvi_send_lane_init(nvi_send_lane *lane, size_t depth)
+{
+	size_t slots = nvi_send_queue_slots(depth);
+
+	/* every slot may be queued at once while the sender is stuck in the
+	 * other lane, only it evicts under drop-oldest */
+	lane->ready = new nvi_send_ring(slots);
+	lane->free = new nvi_send_ring(slots);
+	lane->items.resize(slots);
+	for (auto &item : lane->items) {
+		memset(&item, 0, sizeof(item));
+		lane->free->try_enqueue(&item);
+	}
+}
+
+static void nvi_send_lane_free(nvi_send_lane *lane)
+{
+	for (auto &item : lane->items) {
+		nvi_frame_pool_release(item.frame);
+		nvi_mem_free(item.data);
+	}
+	lane->items.clear();
+	delete lane->ready;
+	delete lane->free;
+	lane->ready = nullptr;
+	lane->free = nullptr;
+}
+
+static nvi_send_item *nvi_send_lane_acquire(nvi_send_queue *q, nvi_send_lane *lane)
+{
+	nvi_send_item *item = nullptr;
+
+	if (q->policy == NVI_DROP_NEWEST && lane->ready->size_approx() >= q->depth) {
+		lane->drops++;
+		return nullptr;
+	}
+
+	/* all slots are queued or in flight, the sender is stuck: nothing
+	 * left to evict from this side, so the newest frame goes */
+	if (!lane->free->try_dequeue(item)) {
+		lane->drops++;
+		return nullptr;
+	}
+	return item;
+}
+
+/* returns false when the item could not be queued, it is back on free */
+static bool nvi_send_lane_commit(nvi_send_queue *q, nvi_send_lane *lane, nvi_send_item *item)
+{
+	if (!lane->ready->try_enqueue(item)) {
+		nvi_frame_pool_release(item->frame);
+		item->frame = nullptr;
+		lane->free->try_enqueue(item);
+		lane->drops++;
+		return false;
+	}
+
+	size_t size = lane->ready->size_approx();
+	size_t high = lane->high_water.load(std::memory_order_relaxed);
+	while (size > high && !lane->high_water.compare_exchange_weak(high, size, std::memory_order_relaxed))
+		;
+
+	q->wake.signal();
+	return true;
+}
+
+static void nvi_update_rect_union(NVIUpdateRect *into, const NVIUpdateRect *rect)
+{
+	if (!rect->width || !rect->height)
+		return;
+	if (!into->width || !into->height) {
+		*into = *rect;
+		return;
+	}
+
+	uint32_t right = std::max(into->x + into->width, rect->x + rect->width);
+	uint32_t bottom = std::max(into->y + into->height, rect->y + rect->height);
+	into->x = std::min(into->x, rect->x);
+	into->y = std::min(into->y, rect->y);
+	into->width = right - into->x;
+	into->height = bottom - into->y;
+}
+
+static void nvi_send_lane_drop_rect(nvi_send_lane *lane, const NVIVideoImageFrame *image)
+{
+	if (!image->updated)
+		lane->dropped_full = true;
+	else
+		nvi_update_rect_union(&lane->dropped_rect, image->updated);
+}
+
+static void nvi_send_lane_apply_rect(nvi_send_lane *lane, NVIVideoImageFrame *image)
+{
+	if (lane->dropped_full)
+		image->updated = nullptr;
+	else if (image->updated)
+		nvi_update_rect_union(image->updated, &lane->dropped_rect);
+	lane->dropped_rect = {};
+	lane->dropped_full = false;
+}
+
+/* returns true when an item was taken off the lane */
+static bool nvi_send_lane_drain_one(nvi_send_queue *q, nvi_send_lane *lane, bool video)
+{
+	nvi_send_item *item = nullptr;
+	if (!lane->ready->try_dequeue(item))
+		return false;
+
+	/* drop-oldest: the producer may overfill by one, the stale head goes */
+	if (q->policy == NVI_DROP_OLDEST && lane->ready->size_approx() >= q->depth) {
+		if (video)
+			nvi_send_lane_drop_rect(lane, &item->image);
+		lane->drops++;
+	} else {
+		if (video) {
+			nvi_send_lane_apply_rect(lane, &item->image);
+			nvi_send_video_timed(q->sender, &item->image, q->video_timing);
+		}
+		else
+			NVISendAudio(q->sender, &item->wave);
+		lane->sent++;
+	}
+
+	nvi_frame_pool_release(item->frame);
+	item->frame = nullptr;
+	lane->free->try_enqueue(item);
+	return true;
+}
+
+static void nvi_send_thread(nvi_send_queue *q)
+{
+	os_set_thread_name("nvi-output: sender");
+
+	while (!q->stopping) {
+		q->wake.wait();
+
+		bool busy = true;
+		while (busy && !q->stopping) {
+			busy = nvi_send_lane_drain_one(q, &q->audio, false);
+			busy |= nvi_send_lane_drain_one(q, &q->video, true);
+		}
+	}
+}
+
+nvi_send_queue *nvi_send_queue_create(NVI_SENDER sender, size_t depth, nvi_drop_policy policy,
+				      nvi_frame_pool *video_pool, nvi_send_timing *video_timing)
+{
+	auto q = new nvi_send_queue();
+	q->sender = sender;
+	q->video_pool = video_pool;
+	q->video_timing = video_timing;
+	q->depth = depth ? depth : 1;
+	q->policy = policy;
+
+	nvi_send_lane_init(&q->video, q->depth);
+	nvi_send_lane_init(&q->audio, q->depth);
+
+	q->thread = std::thread(nvi_send_thread, q);
+#ifdef WIN32
+	SetThreadPriority(q->thread.native_handle(), THREAD_PRIORITY_HIGHEST);
+#endif
+	return q;
+}
+
+void nvi_send_queue_destroy(nvi_send_queue *q)
+{
+	if (!q)
+		return;
+
+	q->stopping = true;
+	q->wake.signal();
+	if (q->thread.joinable())
+		q->thread.join();
+
+	nvi_send_lane_free(&q->video);
+	nvi_send_lane_free(&q->audio);
+	delete q;
+}
+
+bool nvi_send_queue_push_video(nvi_send_queue *q, const NVIVideoImageFrame *image)
+{
+	if (!q->video_pool)
+		return false;
+
+	nvi_send_item *item = nvi_send_lane_acquire(q, &q->video);
+	if (!item)
+		return false;
+
+	nvi_pool_frame *frame = nvi_frame_pool_acquire(q->video_pool);
+	nvi_pool_frame_copy(frame, image->buffer.planes, image->buffer.strides);
+
+	item->frame = frame;
+	item->image = *image;
+	if (image->updated) {
+		item->updated = *image->updated;
+		item->image.updated = &item->updated;
+	}
+	for (size_t i = 0; i < frame->plane_count; i++) {
+		item->image.buffer.planes[i] = frame->planes[i];
+		item->image.buffer.strides[i] = frame->strides[i];
+	}
+
+	return nvi_send_lane_commit(q, &q->video, item);
+}
+
+bool nvi_send_queue_push_audio(nvi_send_queue *q, const NVIAudioWaveFrame *wave)
+{
+	nvi_send_item *item = nvi_send_lane_acquire(q, &q->audio);
+	if (!item)
+		return false;
+
+	nvi_send_item_reserve(item, wave->buffer.size);
+	item->wave = *wave;
+	memcpy(item->data, wave->buffer.data, wave->buffer.size);
+	item->wave.buffer.data = item->data;
+
+	return nvi_send_lane_commit(q, &q->audio, item);
+}
+
+void nvi_send_queue_log_stats(nvi_send_queue *q, const char *name)
+{
+	blog(LOG_INFO,
+	     "'%s': nvi send queue (depth %zu, %s): video sent %llu dropped %llu high-water %zu, "
+	     "audio sent %llu dropped %llu high-water %zu",
+	     name, q->depth, q->policy == NVI_DROP_OLDEST ? "drop oldest" : "drop newest",
+	     (unsigned long long)q->video.sent.load(), (unsigned long long)q->video.drops.load(),
+	     q->video.high_water.load(), (unsigned long long)q->audio.sent.load(),
+	     (unsigned long long)q->audio.drops.load(), q->audio.high_water.load());
+}
+
+int32_t nvi_send_video_timed(NVI_SENDER sender, const NVIVideoImageFrame *image, nvi_send_timing *timing)
+{
+	if (!timing)
+		return NVISendVideo(sender, image);
+
+	uint64_t start = os_gettime_ns();
+	int32_t err = NVISendVideo(sender, image);
+	uint64_t took = os_gettime_ns() - start;
+
+	timing->frames++;
+	timing->total_ns += took;
+	if (took > timing->max_ns)
+		timing->max_ns = took;
+	if (timing->budget_ns && took > timing->budget_ns)
+		timing->over_budget++;
+	return err;
+}
+
+void nvi_send_timing_log(const nvi_send_timing *timing, const char *name)
+{
+	if (!timing->frames)
+		return;
+
+	/* the slices of a frame encode in parallel, so this is the slowest
+	 * slice plus the split and merge around it */
+	blog(LOG_INFO,
+	     "'%s': nvi video encode with %u slices: avg %.2f ms, max %.2f ms per frame, "
+	     "%llu of %llu frames over the %.2f ms budget",
+	     name, timing->slices, timing->total_ns / (double)timing->frames / 1000000.0,
+	     timing->max_ns / 1000000.0, (unsigned long long)timing->over_budget,
+	     (unsigned long long)timing->frames, timing->budget_ns / 1000000.0);
+}
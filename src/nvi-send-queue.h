@@ -0,0 +1,89 @@
+#pragma once
+#include <obs-module.h>
+#include <nvi/API.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "readerwritercircularbuffer.h"
+#include "nvi-frame-pool.h"
+
+enum nvi_drop_policy {
+	NVI_DROP_OLDEST = 0,
+	NVI_DROP_NEWEST = 1,
+};
+
+/* one queued frame, owns a copy of the planes/samples it points to */
+struct nvi_send_item {
+	NVIVideoImageFrame image;
+	nvi_pool_frame *frame;
+	NVIUpdateRect updated;
+
+	NVIAudioWaveFrame wave;
+	uint8_t *data;
+	size_t capacity;
+};
+
+/* time spent in NVISendVideo, which is where the sender encodes; written by
+ * whichever thread sends, read once sending has stopped */
+struct nvi_send_timing {
+	uint64_t budget_ns;
+	uint32_t slices;
+	uint64_t frames;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t over_budget;
+};
+
+typedef moodycamel::BlockingReaderWriterCircularBuffer<nvi_send_item *> nvi_send_ring;
+
+/* producer (obs video or audio thread) -> sender thread, and the way back */
+struct nvi_send_lane {
+	nvi_send_ring *ready = nullptr;
+	nvi_send_ring *free = nullptr;
+	std::vector<nvi_send_item> items;
+
+	std::atomic<uint64_t> drops{0};
+	std::atomic<size_t> high_water{0};
+	std::atomic<uint64_t> sent{0};
+
+	/* what frames dropped on the sender thread changed, folded into the
+	 * next one sent so the receiver misses nothing */
+	NVIUpdateRect dropped_rect = {};
+	bool dropped_full = false;
+};
+
+struct nvi_send_queue {
+	NVI_SENDER sender = nullptr;
+	size_t depth = 0;
+	nvi_drop_policy policy = NVI_DROP_OLDEST;
+	nvi_frame_pool *video_pool = nullptr;
+	nvi_send_timing *video_timing = nullptr;
+
+	nvi_send_lane video;
+	nvi_send_lane audio;
+
+	moodycamel::spsc_sema::LightweightSemaphore wake;
+	std::atomic<bool> stopping{false};
+	std::thread thread;
+};
+
+/* a video lane holds at most this many pool frames at once */
+static inline size_t nvi_send_queue_slots(size_t depth)
+{
+	/* depth queued + one extra for drop-oldest, one in flight, one being filled */
+	return depth + 2;
+}
+
+extern nvi_send_queue *nvi_send_queue_create(NVI_SENDER sender, size_t depth, nvi_drop_policy policy,
+					     nvi_frame_pool *video_pool, nvi_send_timing *video_timing);
+extern void nvi_send_queue_destroy(nvi_send_queue *q);
+
+/* copy the frame into a free slot and hand it to the sender thread,
+ * returns false when the frame was dropped */
+extern bool nvi_send_queue_push_video(nvi_send_queue *q, const NVIVideoImageFrame *image);
+extern bool nvi_send_queue_push_audio(nvi_send_queue *q, const NVIAudioWaveFrame *wave);
+
+extern void nvi_send_queue_log_stats(nvi_send_queue *q, const char *name);
+
+extern int32_t nvi_send_video_timed(NVI_SENDER sender, const NVIVideoImageFrame *image, nvi_send_timing *timing);
+extern void nvi_send_timing_log(const nvi_send_timing *timing, const char *name);
@@ -0,0 +1,165 @@
+#include "nvi-signal-loss.h"
+#include <stdio.h>
+
+#define NVI_FADE_NS 1000000000ULL
+
+static void nvi_signal_loss_free_slate(nvi_signal_loss *loss)
+{
+	obs_enter_graphics();
+	gs_image_file_free(&loss->slate);
+	obs_leave_graphics();
+}
+
+void nvi_signal_loss_configure(nvi_signal_loss *loss, nvi_loss_policy policy, uint32_t timeout_s,
+			       const char *slate_path)
+{
+	loss->policy = policy;
+	loss->timeout_ns = (uint64_t)timeout_s * 1000000000ULL;
+
+	std::string path = slate_path ? slate_path : "";
+	if (path == loss->slate_path)
+		return;
+
+	nvi_signal_loss_free_slate(loss);
+	loss->slate_path = path;
+	if (path.empty())
+		return;
+
+	/* decoded to system memory only, no texture is created */
+	gs_image_file_init(&loss->slate, path.c_str());
+	if (!loss->slate.loaded)
+		blog(LOG_WARNING, "nvi: could not load slate image '%s'", path.c_str());
+}
+
+void nvi_signal_loss_free(nvi_signal_loss *loss)
+{
+	nvi_signal_loss_free_slate(loss);
+	loss->slate_path.clear();
+}
+
+void nvi_signal_loss_begin(nvi_signal_loss *loss, uint64_t lost_at)
+{
+	if (loss->lost_at)
+		return;
+
+	loss->lost_at = lost_at ? lost_at : 1;
+	loss->next_ns = 0;
+	loss->shown = false;
+	loss->blanked = false;
+	loss->active = true;
+	loss->losses++;
+}
+
+uint64_t nvi_signal_loss_end(nvi_signal_loss *loss, uint64_t now)
+{
+	if (!loss->lost_at)
+		return 0;
+
+	uint64_t gap = now > loss->lost_at ? now - loss->lost_at : 0;
+	if (gap > loss->longest_ns)
+		loss->longest_ns = gap;
+	loss->lost_at = 0;
+	loss->active = false;
+	return gap;
+}
+
+static bool nvi_signal_loss_slate_frame(const gs_image_file_t *image, obs_source_frame *frame)
+{
+	*frame = {};
+	if (!image->loaded || !image->texture_data)
+		return false;
+
+	switch (image->format) {
+	case GS_BGRA:
+		frame->format = VIDEO_FORMAT_BGRA;
+		break;
+	case GS_BGRX:
+		frame->format = VIDEO_FORMAT_BGRX;
+		break;
+	case GS_RGBA:
+		frame->format = VIDEO_FORMAT_RGBA;
+		break;
+	default:
+		return false;
+	}
+	frame->width = image->cx;
+	frame->height = image->cy;
+	frame->data[0] = image->texture_data;
+	frame->linesize[0] = image->cx * 4;
+	return true;
+}
+
+/* without a loaded slate obs keeps showing its own copy of the last frame */
+static void nvi_signal_loss_show_slate(nvi_signal_loss *loss, obs_source_t *source, uint64_t now)
+{
+	obs_source_frame frame;
+	if (nvi_signal_loss_slate_frame(&loss->slate, &frame)) {
+		frame.timestamp = now;
+		obs_source_output_video(source, &frame);
+	}
+	loss->shown = true;
+}
+
+uint64_t nvi_signal_loss_tick(nvi_signal_loss *loss, obs_source_t *source, const obs_source_frame *last,
+			      uint64_t interval_ns, uint64_t now)
+{
+	if (!loss->lost_at || loss->blanked)
+		return UINT64_MAX;
+
+	uint64_t elapsed = now > loss->lost_at ? now - loss->lost_at : 0;
+	if (loss->timeout_ns && elapsed >= loss->timeout_ns) {
+		/* without a frame obs reports the async source as inactive */
+		obs_source_output_video(source, nullptr);
+		loss->blanked = true;
+		loss->timeouts++;
+		return UINT64_MAX;
+	}
+
+	uint64_t deadline = loss->timeout_ns ? loss->lost_at + loss->timeout_ns : UINT64_MAX;
+	if (loss->shown)
+		return deadline;
+
+	obs_source_frame frame;
+	switch (loss->policy) {
+	case NVI_LOSS_SLATE:
+		nvi_signal_loss_show_slate(loss, source, now);
+		return deadline;
+
+	case NVI_LOSS_FADE: {
+		/* the color matrix is only applied to yuv, and unbuffered frames
+		 * are gone once obs has copied them */
+		if (!last || !format_is_yuv(last->format)) {
+			nvi_signal_loss_show_slate(loss, source, now);
+			return deadline;
+		}
+		if (now < loss->next_ns)
+			return loss->next_ns < deadline ? loss->next_ns : deadline;
+
+		float gain = elapsed >= NVI_FADE_NS ? 0.0f : 1.0f - (float)elapsed / (float)NVI_FADE_NS;
+		frame = *last;
+		/* rows 0-2 give r, g and b including their offsets, scaling them
+		 * darkens the picture without touching the planes */
+		for (size_t i = 0; i < 12; i++)
+			frame.color_matrix[i] *= gain;
+		frame.timestamp = now;
+		obs_source_output_video(source, &frame);
+
+		loss->shown = gain == 0.0f;
+		loss->next_ns = now + (interval_ns ? interval_ns : NVI_FADE_NS / 25);
+		if (loss->shown)
+			return deadline;
+		return loss->next_ns < deadline ? loss->next_ns : deadline;
+	}
+
+	default:
+		/* obs keeps showing its own copy of the last frame */
+		return deadline;
+	}
+}
+
+void nvi_signal_loss_describe(const nvi_signal_loss *loss, char *text, size_t size)
+{
+	snprintf(text, size, "Signal %s, %llu losses, longest %.1f s, %llu timeouts", loss->active ? "lost" : "ok",
+		 (unsigned long long)loss->losses.load(), loss->longest_ns / 1000000000.0,
+		 (unsigned long long)loss->timeouts.load());
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <obs-module.h>
+#include <graphics/image-file.h>
+#include <atomic>
+#include <string>
+
+enum nvi_loss_policy {
+	NVI_LOSS_HOLD = 0,
+	NVI_LOSS_FADE = 1,
+	NVI_LOSS_SLATE = 2,
+};
+
+/* what the source shows between losing its stream and getting it back; only
+ * the receive thread touches it, the counters are for the UI */
+struct nvi_signal_loss {
+	nvi_loss_policy policy = NVI_LOSS_HOLD;
+	/* 0 conceals until the stream returns */
+	uint64_t timeout_ns = 0;
+	std::string slate_path;
+	gs_image_file_t slate = {};
+
+	/* 0 while the stream is flowing */
+	uint64_t lost_at = 0;
+	uint64_t next_ns = 0;
+	/* the slate or the final fade frame is out, obs holds it from here */
+	bool shown = false;
+	bool blanked = false;
+
+	std::atomic<bool> active{false};
+	std::atomic<uint64_t> losses{0};
+	std::atomic<uint64_t> timeouts{0};
+	std::atomic<uint64_t> longest_ns{0};
+};
+
+extern void nvi_signal_loss_configure(nvi_signal_loss *loss, nvi_loss_policy policy, uint32_t timeout_s,
+				      const char *slate_path);
+extern void nvi_signal_loss_free(nvi_signal_loss *loss);
+
+extern void nvi_signal_loss_begin(nvi_signal_loss *loss, uint64_t lost_at);
+/* a video frame came in, returns how long the gap was, 0 if there was none */
+extern uint64_t nvi_signal_loss_end(nvi_signal_loss *loss, uint64_t now);
+
+static inline bool nvi_signal_loss_active(const nvi_signal_loss *loss)
+{
+	return loss->lost_at != 0;
+}
+
+/* covers the gap; last is the jitter buffer's frame on screen, null when
+ * nothing keeps one. fade needs a yuv one, without it the slate is shown if
+ * there is one and obs holds the last frame otherwise. returns when to call
+ * again, UINT64_MAX when nothing is left to do */
+extern uint64_t nvi_signal_loss_tick(nvi_signal_loss *loss, obs_source_t *source, const obs_source_frame *last,
+				     uint64_t interval_ns, uint64_t now);
+
+extern void nvi_signal_loss_describe(const nvi_signal_loss *loss, char *text, size_t size);
@@ -1,59 +1,543 @@
 
 
 #include <obs-module.h>
+#include <util/platform.h>
+#include <util/threading.h>
 #include <NVI/API.h>
 #include <thread>
+#include <functional>
 #include "obs-nvi.h"
+#include "nvi-memory.h"
+#include "nvi-audio-convert.h"
+#include "nvi-clock.h"
+#include "nvi-jitter-buffer.h"
+#include "nvi-signal-loss.h"
+#include "nvi-recv-pool.h"
+#include "nvi-discovery.h"
 #include "concurrentqueue.h"
-#include <qstring.h>
+#include "atomicops.h"
+#include <string>
+#ifdef WIN32
 #include <Windows.h>
+#endif
 
 #define PROP_SOURCE "NVI Sources"
+#define PROP_RESCAN "rescan"
+#define PROP_LATENCY_MODE "latency_mode"
+#define PROP_JITTER_TARGET "jitter_target_ms"
+#define PROP_JITTER_MIN "jitter_min_frames"
+#define PROP_JITTER_MAX "jitter_max_frames"
+#define PROP_RECV_THREAD "recv_thread"
+#define PROP_ACCEL "decode_accel"
+#define PROP_ACCEL_DRM "decode_accel_drm"
+#define PROP_MEDIA "media"
+#define PROP_AUDIO_WHEN_HIDDEN "audio_only_hidden"
+#define PROP_PROXY "proxy_off_program"
+#define PROP_FAILOVER "fast_failover"
+#define PROP_STANDBY_LOCAL "standby_local"
+#define PROP_LOSS_POLICY "loss_policy"
+#define PROP_LOSS_TIMEOUT "loss_timeout_s"
+#define PROP_LOSS_SLATE "loss_slate"
+#define PROP_STATS "source_stats"
+#define PROP_STATS_REFRESH "stats_refresh"
+
+#define NVI_RETRY_MIN_MS 250
+#define NVI_RETRY_MAX_MS 10000
+/* only bounds how long a command waits while a stream has stalled, frames
+ * return from NVIRecvFrame as soon as they arrive */
+#define NVI_RECV_TIMEOUT_MS 100
+#define NVI_STANDBY_RETRY_MS 2000
+/* frame intervals without input before signal loss or switching to a
+ * standby that has some */
+#define NVI_STALL_FRAMES 3
+#define NVI_DECODE_LOG_NS 10000000000ULL
+/* how long a pending receiver may take to deliver its first frame; grows
+ * on every miss while the main stream's gop is not known yet */
+#define NVI_PENDING_TIMEOUT_NS 3000000000ULL
+#define NVI_PENDING_TIMEOUT_MAX_NS 24000000000ULL
 
 using namespace moodycamel;
 
+enum nvi_media_mode {
+	NVI_MEDIA_AV = 0,
+	NVI_MEDIA_AUDIO = 1,
+	NVI_MEDIA_VIDEO = 2,
+};
+
+/* what a receiver was opened with, see nvi_source_alloc_recver */
+#define NVI_RECV_PROXY 0x1
+#define NVI_RECV_NO_VIDEO 0x2
+#define NVI_RECV_NO_AUDIO 0x4
 
 struct nvi_source {
-	bool is_running;
-	bool should_quit;
-	obs_source_t *source;
+	bool should_quit = false;
+	obs_source_t *source = nullptr;
 	NVI_RECVER recver = 0;
-	std::thread* pthread = 0;
-	QString cur_nvi_sites_alias;
-	ConcurrentQueue<std::function<void()>>* task_queue;
-	uint8_t audio_buffer[16][48000 * 4];
+	std::thread thread;
+	/* "sites:alias" from the settings, hashed once so lookups are one probe */
+	std::string stream_key;
+	uint64_t stream_key_hash = 0;
+	nvi_clock clock = {};
+	nvi_latency_mode latency_mode = NVI_LATENCY_NORMAL;
+	nvi_jitter_buffer jitter;
+	nvi_signal_loss loss;
+	ConcurrentQueue<std::function<void()>> task_queue;
+	spsc_sema::LightweightSemaphore wake;
+
+	/* either the dedicated thread or the shared pool runs the receiver */
+	std::atomic<bool> pooled{false};
+	nvi_recv_task task;
+
+	/* 0 when no reconnect is pending */
+	uint64_t retry_at = 0;
+	uint32_t retry_ms = NVI_RETRY_MIN_MS;
+
+	/* fast failover: a second receiver is kept open and drained alongside
+	 * the active one, so a switch costs no connect. uris are interned.
+	 * written on the receive thread, the atomics are what describe reads */
+	std::atomic<bool> failover{false};
+	std::string standby_local;
+	NVI_RECVER standby = 0;
+	const char *active_uri = nullptr;
+	const char *active_alias = nullptr;
+	bool active_alt_local = false;
+	bool standby_alt_local = false;
+	std::atomic<const char *> standby_uri{nullptr};
+	/* 0 when no standby attempt is pending */
+	uint64_t standby_at = 0;
+	uint64_t standby_last_ns = 0;
+	uint64_t last_frame_ns = 0;
+	uint64_t frame_interval_ns = 40000000;
+	/* last frame before a switch, until the new receiver delivers one */
+	uint64_t switch_from_ns = 0;
+	std::atomic<uint64_t> switches{0};
+	std::atomic<uint64_t> switch_last_ns{0};
+	std::atomic<uint64_t> switch_max_ns{0};
+
+	/* proxy while off program, audio only while hidden; a receiver with
+	 * other flags opens as pending and takes over with its first frame, so
+	 * a switch shows no gap */
+	nvi_media_mode media = NVI_MEDIA_AV;
+	bool audio_when_hidden = true;
+	bool proxy_mode = false;
+	bool shown = false;
+	bool on_program = false;
+	bool caps_proxy = false;
+	std::atomic<uint32_t> recv_flags{0};
+	NVI_RECVER pending = 0;
+	uint32_t pending_flags = 0;
+	uint64_t pending_until = 0;
+	uint64_t pending_window_ns = NVI_PENDING_TIMEOUT_NS;
+	/* 0 when no retry of a failed switch is due */
+	uint64_t retarget_at = 0;
+	uint32_t retarget_ms = NVI_RETRY_MIN_MS;
+	/* keyframe distance of the full stream, 0 until two were seen */
+	uint64_t last_intra_ns = 0;
+	uint64_t main_gop_ns = 0;
+	std::atomic<uint64_t> recv_switches{0};
+
+	/* decode accelerator from the settings, and what the receiver got */
+	int32_t accel = NVIAccel_Auto;
+	std::string accel_drm;
+	std::atomic<int32_t> accel_used{NVIAccel_Auto};
+	std::atomic<uint64_t> decode_frames{0};
+	std::atomic<uint64_t> decode_total_ns{0};
+	std::atomic<uint64_t> decode_max_ns{0};
+	uint64_t decode_log_at = 0;
+	uint64_t decode_window_frames = 0;
+	uint64_t decode_window_ns = 0;
+	uint64_t decode_window_max_ns = 0;
 };
-	
+
+/* commands run on the receive thread, the signal ends an idle or backoff wait */
+static void nvi_source_post(nvi_source *s, std::function<void()> task)
+{
+	s->task_queue.enqueue(std::move(task));
+	if (s->pooled)
+		nvi_recv_pool_wake(&s->task);
+	else
+		s->wake.signal();
+}
+
+/* receive threads share one audio staging buffer across the sources they
+ * serve, sized from the stream's own wave info on first use */
+struct nvi_audio_staging {
+	uint8_t *data = nullptr;
+	size_t size = 0;
+
+	~nvi_audio_staging() { nvi_mem_free(data); }
+};
+
+static uint8_t *nvi_thread_audio_staging(const NVIWaveInfo *info, size_t samples, size_t sample_bytes)
+{
+	thread_local nvi_audio_staging staging;
+
+	/* at least 20 ms so packet size jitter does not reallocate */
+	size_t frames = samples > info->sample_rate / 50 ? samples : info->sample_rate / 50;
+	size_t size = frames * info->channels * sample_bytes;
+	if (staging.size >= size)
+		return staging.data;
+
+	nvi_mem_free(staging.data);
+	staging.data = (uint8_t *)nvi_mem_alloc(size);
+	staging.size = staging.data ? size : 0;
+	return staging.data;
+}
+
+/* obs has no 24-bit format, widen to 32-bit keeping the sample in the top bits */
+static const uint8_t *nvi_widen_s24(const NVIAudioWaveFrame *wave)
+{
+	size_t count = (size_t)wave->buffer.samples * wave->info.channels;
+	auto dst = (int32_t *)nvi_thread_audio_staging(&wave->info, wave->buffer.samples, sizeof(int32_t));
+	if (!dst || wave->buffer.size < count * 3)
+		return nullptr;
+
+	const uint8_t *src = wave->buffer.data;
+	for (size_t i = 0; i < count; i++, src += 3)
+		dst[i] = (int32_t)(((uint32_t)src[0] << 8) | ((uint32_t)src[1] << 16) | ((uint32_t)src[2] << 24));
+	return (const uint8_t *)dst;
+}
+
 const char *nvi_source_getname(void *data)
 {
 	UNUSED_PARAMETER(data);
 	return "NVI Source";
 }
 
-void nvi_reconnect(void *data, QString sites_alias)
+static void nvi_source_schedule_retry(nvi_source *s)
 {
-	auto s = (nvi_source *)data;
-	s->is_running = false;
-	int idx = 0;
-	bool found = false;
-	for (; idx < g_nvi_streams.size(); idx++) {
-		QString str = QString(g_nvi_streams[idx].sites) + ":" + QString(g_nvi_streams[idx].alias);
-		if (str == sites_alias) {
-			found = true;
-			break;
+	if (s->recver) {
+		NVIRecvFree(s->recver);
+		s->recver = 0;
+	}
+	uint64_t now = os_gettime_ns();
+	nvi_signal_loss_begin(&s->loss, now);
+	s->retry_at = now + (uint64_t)s->retry_ms * 1000000ULL;
+	blog(LOG_INFO, "nvi source '%s': retrying '%s' in %u ms", obs_source_get_name(s->source),
+	     s->stream_key.c_str(), s->retry_ms);
+	s->retry_ms = s->retry_ms * 2 < NVI_RETRY_MAX_MS ? s->retry_ms * 2 : NVI_RETRY_MAX_MS;
+}
+
+static const char *nvi_accel_name(int32_t type)
+{
+	switch (type) {
+	case NVIAccel_CPU:
+		return "CPU";
+	case NVIAccel_Auto:
+		return "Auto";
+	case NVIAccel_NVCodec:
+		return "NVCodec";
+	case NVIAccel_DXVA2:
+		return "DXVA2";
+	case NVIAccel_D3D11VA:
+		return "D3D11VA";
+	case NVIAccel_VideoToolbox:
+		return "VideoToolbox";
+	case NVIAccel_MediaCodec:
+		return "MediaCodec";
+	case NVIAccel_VAAPI:
+		return "VAAPI";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *nvi_recv_flags_name(uint32_t flags)
+{
+	if (flags & NVI_RECV_NO_VIDEO)
+		return "audio only";
+	if (flags & NVI_RECV_NO_AUDIO)
+		return flags & NVI_RECV_PROXY ? "proxy video only" : "video only";
+	return flags & NVI_RECV_PROXY ? "proxy" : "main";
+}
+
+static uint32_t nvi_source_wanted_flags(nvi_source *s)
+{
+	if (s->media == NVI_MEDIA_AUDIO || (s->media == NVI_MEDIA_AV && s->audio_when_hidden && !s->shown))
+		return NVI_RECV_NO_VIDEO;
+
+	uint32_t flags = s->media == NVI_MEDIA_VIDEO ? NVI_RECV_NO_AUDIO : 0;
+	if (s->proxy_mode && !s->on_program && s->caps_proxy)
+		flags |= NVI_RECV_PROXY;
+	return flags;
+}
+
+/* the accelerator has to be set before the first NVIRecvFrame, a preset the
+ * library refuses falls back to software rather than failing the stream.
+ * meta data is never used, so it is never received */
+static NVI_RECVER nvi_source_alloc_recver(nvi_source *s, const NVIRecvAllocParam *base, uint32_t flags)
+{
+	NVIRecvAllocParam param = *base;
+	param.flags_rx_proxy = (flags & NVI_RECV_PROXY) != 0;
+	param.flags_off_video = (flags & NVI_RECV_NO_VIDEO) != 0;
+	param.flags_off_audio = (flags & NVI_RECV_NO_AUDIO) != 0;
+	param.flags_off_meta = 1;
+	NVI_RECVER recver = NVIRecvAlloc(g_nvi_ctx, &param);
+	if (!recver)
+		return 0;
+	if (flags & NVI_RECV_NO_VIDEO) {
+		blog(LOG_INFO, "nvi source '%s': '%s' audio only", obs_source_get_name(s->source), param.remote);
+		return recver;
+	}
+
+	NVIVideoAccelerate accel{};
+	accel.type = s->accel;
+	if (s->accel == NVIAccel_VAAPI) {
+		accel.context.vaapi.drm = s->accel_drm.empty() ? nullptr : s->accel_drm.c_str();
+	} else if (s->accel == NVIAccel_NVCodec) {
+		accel.context.cuda.device = 0;
+		accel.context.cuda.use_primary_context = true;
+	}
+
+	int32_t used = s->accel;
+	int32_t err = NVIRecvVideoAccelPreset(recver, &accel);
+	if (err < 0 && s->accel != NVIAccel_CPU) {
+		blog(LOG_WARNING, "nvi source '%s': %s decode preset failed (%d), falling back to CPU",
+		     obs_source_get_name(s->source), nvi_accel_name(s->accel), err);
+		accel = {};
+		accel.type = NVIAccel_CPU;
+		err = NVIRecvVideoAccelPreset(recver, &accel);
+		used = NVIAccel_CPU;
+	}
+	if (err < 0)
+		used = NVIAccel_Auto;
+
+	s->accel_used = used;
+	blog(LOG_INFO, "nvi source '%s': '%s' %s decoding on %s%s%s", obs_source_get_name(s->source), param.remote,
+	     nvi_recv_flags_name(flags), nvi_accel_name(used),
+	     used == NVIAccel_VAAPI && accel.context.vaapi.drm ? " " : "",
+	     used == NVIAccel_VAAPI && accel.context.vaapi.drm ? accel.context.vaapi.drm : "");
+	return recver;
+}
+
+/* NVIRecvFrame decodes inline, so the time of a call that returns a picture
+ * is its decode time, plus any wait for the packet when the call blocked */
+static void nvi_source_track_decode(nvi_source *s, const NVIVideoImageFrame *image, uint64_t elapsed, uint64_t now)
+{
+	s->decode_frames++;
+	s->decode_total_ns += elapsed;
+	if (elapsed > s->decode_max_ns)
+		s->decode_max_ns = elapsed;
+	blog(LOG_DEBUG, "nvi source '%s': frame %ux%u codec %u in %.2f ms", obs_source_get_name(s->source),
+	     image->info.width, image->info.height, image->info.codec, elapsed / 1000000.0);
+
+	s->decode_window_frames++;
+	s->decode_window_ns += elapsed;
+	if (elapsed > s->decode_window_max_ns)
+		s->decode_window_max_ns = elapsed;
+	if (!s->decode_log_at) {
+		s->decode_log_at = now + NVI_DECODE_LOG_NS;
+	} else if (now >= s->decode_log_at) {
+		blog(LOG_INFO, "nvi source '%s': %s decode, %llu frames, avg %.2f ms, max %.2f ms",
+		     obs_source_get_name(s->source), nvi_accel_name(s->accel_used),
+		     (unsigned long long)s->decode_window_frames,
+		     s->decode_window_ns / 1000000.0 / s->decode_window_frames, s->decode_window_max_ns / 1000000.0);
+		s->decode_log_at = now + NVI_DECODE_LOG_NS;
+		s->decode_window_frames = 0;
+		s->decode_window_ns = 0;
+		s->decode_window_max_ns = 0;
+	}
+}
+
+static void nvi_source_drop_standby(nvi_source *s)
+{
+	if (s->standby) {
+		NVIRecvFree(s->standby);
+		s->standby = 0;
+	}
+	s->standby_uri = nullptr;
+	s->standby_at = 0;
+}
+
+static void nvi_source_drop_pending(nvi_source *s)
+{
+	if (s->pending) {
+		NVIRecvFree(s->pending);
+		s->pending = 0;
+	}
+	s->pending_until = 0;
+}
+
+/* a switch that failed is tried again with a backoff, as long as the
+ * active receiver still has the wrong flags */
+static void nvi_source_schedule_retarget(nvi_source *s, uint64_t now)
+{
+	s->retarget_at = now + (uint64_t)s->retarget_ms * 1000000ULL;
+	s->retarget_ms = s->retarget_ms * 2 < NVI_RETRY_MAX_MS ? s->retarget_ms * 2 : NVI_RETRY_MAX_MS;
+}
+
+/* the full stream may need a whole gop before its first picture */
+static uint64_t nvi_source_pending_timeout(nvi_source *s, uint32_t flags)
+{
+	uint64_t timeout = s->pending_window_ns;
+	if (!(flags & NVI_RECV_PROXY) && s->main_gop_ns) {
+		uint64_t gop = s->main_gop_ns + NVI_STALL_FRAMES * s->frame_interval_ns;
+		if (gop > timeout)
+			timeout = gop;
+	}
+	return timeout;
+}
+
+/* opens a receiver with other flags when visibility, program state or the
+ * settings no longer match the active one */
+static void nvi_source_retarget(nvi_source *s)
+{
+	uint32_t want = nvi_source_wanted_flags(s);
+	if (s->pending && s->pending_flags != want)
+		nvi_source_drop_pending(s);
+	if (want == s->recv_flags) {
+		s->retarget_at = 0;
+		s->retarget_ms = NVI_RETRY_MIN_MS;
+		s->pending_window_ns = NVI_PENDING_TIMEOUT_NS;
+	}
+	if (!s->recver || s->pending || want == s->recv_flags)
+		return;
+
+	s->retarget_at = 0;
+	NVIRecvAllocParam param{};
+	param.local = s->active_alt_local ? s->standby_local.c_str() : nullptr;
+	param.remote = s->active_uri;
+	s->pending = nvi_source_alloc_recver(s, &param, want);
+	if (!s->pending) {
+		blog(LOG_WARNING, "nvi source '%s': could not open '%s' %s", obs_source_get_name(s->source),
+		     s->active_uri, nvi_recv_flags_name(want));
+		nvi_source_schedule_retarget(s, os_gettime_ns());
+		return;
+	}
+	s->pending_flags = want;
+	s->pending_until = os_gettime_ns() + nvi_source_pending_timeout(s, want);
+}
+
+/* a second path to the active stream: the same uri over another local
+ * interface, or the same alias announced from another site */
+static void nvi_source_arm_standby(nvi_source *s)
+{
+	s->standby_at = 0;
+	if (!s->failover || !s->recver || s->standby)
+		return;
+
+	NVIRecvAllocParam param{};
+	bool alt_local = false;
+	if (!s->standby_local.empty()) {
+		alt_local = !s->active_alt_local;
+		param.local = alt_local ? s->standby_local.c_str() : nullptr;
+		param.remote = s->active_uri;
+	} else {
+		/* interned, equal strings are the same pointer */
+		nvi_stream_snapshot dir = nvi_discovery_snapshot();
+		for (auto &stream : dir->streams) {
+			if (stream.alias == s->active_alias && stream.uri != s->active_uri) {
+				param.remote = stream.uri;
+				break;
+			}
 		}
 	}
-	if (!found)
+	if (param.remote)
+		s->standby = nvi_source_alloc_recver(s, &param, s->recv_flags);
+	if (!s->standby) {
+		s->standby_at = os_gettime_ns() + (uint64_t)NVI_STANDBY_RETRY_MS * 1000000ULL;
 		return;
+	}
+
+	s->standby_alt_local = alt_local;
+	s->standby_uri = param.remote;
+	s->standby_last_ns = 0;
+	blog(LOG_INFO, "nvi source '%s': standby open on '%s'%s%s", obs_source_get_name(s->source), param.remote,
+	     alt_local ? " via " : "", alt_local ? param.local : "");
+}
+
+static void nvi_source_failover(nvi_source *s, uint64_t now, const char *reason)
+{
+	NVIRecvFree(s->recver);
+	s->recver = s->standby;
+	s->active_uri = s->standby_uri;
+	s->active_alt_local = s->standby_alt_local;
+	s->standby = 0;
+	s->standby_uri = nullptr;
+	if (!s->switch_from_ns)
+		s->switch_from_ns = s->last_frame_ns ? s->last_frame_ns : now;
+	s->switches++;
+
+	/* the lost path often comes back, it is the next standby candidate */
+	s->standby_at = now + (uint64_t)NVI_STANDBY_RETRY_MS * 1000000ULL;
+	blog(LOG_WARNING, "nvi source '%s': %s, switched to standby '%s'", obs_source_get_name(s->source), reason,
+	     s->active_uri);
+
+	/* a receiver change in flight was against the old path */
+	nvi_source_drop_pending(s);
+	nvi_source_retarget(s);
+}
+
+/* keeps the standby's buffers empty so the first frame after a switch is
+ * fresh, and notes whether it is still delivering */
+static void nvi_source_drain_standby(nvi_source *s, uint64_t now)
+{
+	for (int i = 0; i < 8; i++) {
+		NVIRecvFrameOut param{};
+		if (NVIRecvFrame(s->standby, &param) < 0) {
+			blog(LOG_INFO, "nvi source '%s': standby '%s' lost", obs_source_get_name(s->source),
+			     s->standby_uri.load());
+			nvi_source_drop_standby(s);
+			s->standby_at = now + (uint64_t)NVI_STANDBY_RETRY_MS * 1000000ULL;
+			return;
+		}
+		if (!param.image_out && !param.wave_out)
+			return;
+		s->standby_last_ns = now;
+	}
+}
+
+static void nvi_source_connect(nvi_source *s)
+{
+	s->retry_at = 0;
+	nvi_source_drop_standby(s);
+	nvi_source_drop_pending(s);
+	s->retarget_at = 0;
+	s->retarget_ms = NVI_RETRY_MIN_MS;
+	s->pending_window_ns = NVI_PENDING_TIMEOUT_NS;
+	s->last_intra_ns = 0;
+	s->main_gop_ns = 0;
 	if (s->recver) {
 		NVIRecvFree(s->recver);
+		s->recver = 0;
 	}
-	NVIRecvAllocParam param{};
-	param.local = nullptr;
-	param.remote = g_nvi_streams[idx].uri;
-	s->recver = NVIRecvAlloc(g_nvi_ctx, &param);
-	s->cur_nvi_sites_alias = sites_alias;
-	s->is_running = true;
+	if (s->stream_key.empty())
+		return;
+
+	nvi_stream_snapshot dir = nvi_discovery_snapshot();
+	const nvi_stream_entry *stream = dir->find(s->stream_key_hash, s->stream_key.c_str());
+	uint32_t flags = 0;
+	if (stream) {
+		s->caps_proxy = stream->caps_proxy_video;
+		flags = nvi_source_wanted_flags(s);
+		NVIRecvAllocParam param{};
+		param.local = nullptr;
+		param.remote = stream->uri;
+		s->recver = nvi_source_alloc_recver(s, &param, flags);
+	}
+	if (!s->recver) {
+		nvi_source_schedule_retry(s);
+		return;
+	}
+
+	s->active_uri = stream->uri;
+	s->active_alias = stream->alias;
+	s->active_alt_local = false;
+	s->recv_flags = flags;
+	s->last_frame_ns = 0;
+	s->switch_from_ns = 0;
+	nvi_clock_reset(&s->clock);
+	nvi_jitter_buffer_flush(&s->jitter);
+	nvi_source_arm_standby(s);
+}
+
+void nvi_reconnect(void *data, const std::string &sites_alias)
+{
+	auto s = (nvi_source *)data;
+	s->stream_key = sites_alias;
+	s->stream_key_hash = nvi_stream_key_hash(sites_alias.c_str());
+	s->retry_ms = NVI_RETRY_MIN_MS;
+	nvi_source_connect(s);
 }
 
 static speaker_layout channel_count_to_layout(int channels)
@@ -82,99 +566,455 @@ static speaker_layout channel_count_to_layout(int channels)
 	}
 }
 
-void nvi_source_poll(void *data)
+static audio_format nvi_planar_format(audio_format format)
+{
+	switch (format) {
+	case AUDIO_FORMAT_U8BIT:
+		return AUDIO_FORMAT_U8BIT_PLANAR;
+	case AUDIO_FORMAT_16BIT:
+		return AUDIO_FORMAT_16BIT_PLANAR;
+	case AUDIO_FORMAT_32BIT:
+		return AUDIO_FORMAT_32BIT_PLANAR;
+	case AUDIO_FORMAT_FLOAT:
+		return AUDIO_FORMAT_FLOAT_PLANAR;
+	default:
+		return format;
+	}
+}
+
+/* NVIWaveBuffer is always interleaved. Mono is already planar and stereo goes
+ * to obs packed, both without a copy. Wider s16/f32 layouts are split into
+ * float planes here, so obs does not have to resample them */
+static void nvi_source_output_audio(nvi_source *s, const NVIAudioWaveFrame *wave)
+{
+	size_t channels = wave->info.channels;
+	size_t frames = wave->buffer.samples;
+	if (!channels || channels > MAX_AV_PLANES || !frames)
+		return;
+
+	/* every platform the plugin ships on is little-endian */
+	uint16_t depth = wave->info.depth & ~NVIWaveBit_Mask_LE;
+	if (depth & NVIWaveBit_Mask_BE) {
+		blog(LOG_WARNING, "nvi source '%s': big-endian pcm is not supported", obs_source_get_name(s->source));
+		return;
+	}
+
+	obs_source_audio frame = {};
+	const uint8_t *samples = wave->buffer.data;
+	size_t sample_bytes;
+	switch (depth) {
+	case NVIWaveBit_8:
+		frame.format = AUDIO_FORMAT_U8BIT;
+		sample_bytes = 1;
+		break;
+	case NVIWaveBit_16:
+		frame.format = AUDIO_FORMAT_16BIT;
+		sample_bytes = 2;
+		break;
+	case NVIWaveBit_24:
+		frame.format = AUDIO_FORMAT_32BIT;
+		sample_bytes = 4;
+		samples = nvi_widen_s24(wave);
+		break;
+	case NVIWaveBit_F32:
+		frame.format = AUDIO_FORMAT_FLOAT;
+		sample_bytes = 4;
+		break;
+	default:
+		return;
+	}
+	if (!samples || (depth != NVIWaveBit_24 && wave->buffer.size < frames * channels * sample_bytes))
+		return;
+
+	frame.speakers = channel_count_to_layout((int)channels);
+	frame.samples_per_sec = wave->info.sample_rate;
+	frame.frames = (uint32_t)frames;
+	frame.timestamp = nvi_clock_map(&s->clock, &s->clock.audio, &wave->info.tick, wave->info.time,
+					os_gettime_ns());
+	/* video sits in the jitter buffer for target_ns, keep audio level with it */
+	if (s->latency_mode == NVI_LATENCY_BUFFERED)
+		frame.timestamp += s->jitter.target_ns;
+
+	if (channels == 1) {
+		frame.format = nvi_planar_format(frame.format);
+		frame.data[0] = samples;
+	} else if (channels > 2 && (depth == NVIWaveBit_16 || depth == NVIWaveBit_F32)) {
+		auto staging = (float *)nvi_thread_audio_staging(&wave->info, frames, sizeof(float));
+		if (!staging)
+			return;
+
+		float *planes[MAX_AV_PLANES];
+		for (size_t ch = 0; ch < channels; ch++) {
+			planes[ch] = staging + ch * frames;
+			frame.data[ch] = (const uint8_t *)planes[ch];
+		}
+		nvi_packed_to_planar_float(depth == NVIWaveBit_16 ? NVI_SAMPLE_S16 : NVI_SAMPLE_F32, samples, planes,
+					   frames, channels);
+		frame.format = AUDIO_FORMAT_FLOAT_PLANAR;
+	} else {
+		frame.data[0] = samples;
+	}
+
+	obs_source_output_audio(s->source, &frame);
+}
+
+static bool nvi_source_fill_video(const NVIVideoImageFrame *image, obs_source_frame *frame)
+{
+	*frame = {};
+	frame->width = image->info.width;
+	frame->height = image->info.height;
+
+	size_t planes;
+	if (image->buffer.format == _NVIPixelFormat::NVIPixel_422P) {
+		frame->format = VIDEO_FORMAT_I422;
+		planes = 3;
+	} else if (image->buffer.format == _NVIPixelFormat::NVIPixel_NV12) {
+		frame->format = VIDEO_FORMAT_NV12;
+		planes = 2;
+	} else {
+		blog(LOG_INFO, "unknown format");
+		return false;
+	}
+	for (size_t i = 0; i < planes; i++) {
+		frame->data[i] = (uint8_t *)image->buffer.planes[i];
+		frame->linesize[i] = image->buffer.strides[i];
+	}
+
+	// todo color sapce 601/709/2020
+	// nvi has no 601
+	// obs has no 2020
+	video_format_get_parameters(VIDEO_CS_709, VIDEO_RANGE_FULL, frame->color_matrix, frame->color_range_min,
+				    frame->color_range_max);
+	return true;
+}
+
+static void nvi_source_output_video(nvi_source *s, const NVIVideoImageFrame *image)
+{
+	obs_source_frame frame;
+	if (!nvi_source_fill_video(image, &frame))
+		return;
+
+	uint64_t now = os_gettime_ns();
+	frame.timestamp = nvi_clock_map(&s->clock, &s->clock.video, &image->info.tick, image->info.time, now);
+
+	uint64_t gap = nvi_signal_loss_end(&s->loss, now);
+	if (gap)
+		blog(LOG_INFO, "nvi source '%s': signal back after %llu ms", obs_source_get_name(s->source),
+		     (unsigned long long)(gap / 1000000));
+
+	if (s->latency_mode == NVI_LATENCY_BUFFERED)
+		nvi_jitter_buffer_push(&s->jitter, &frame, image->buffer.format, image->info.frame_rate_num,
+				       image->info.frame_rate_den, now);
+	else
+		obs_source_output_video(s->source, &frame);
+}
+
+/* covers a gap in the stream, returns when to call again */
+static uint64_t nvi_source_conceal(nvi_source *s, uint64_t now)
+{
+	if (!nvi_signal_loss_active(&s->loss))
+		return UINT64_MAX;
+
+	const obs_source_frame *last = nullptr;
+	if (s->latency_mode == NVI_LATENCY_BUFFERED) {
+		/* what is already buffered plays out first */
+		nvi_jitter_buffer_play(&s->jitter, s->source, now);
+		uint64_t due = nvi_jitter_buffer_next_due(&s->jitter);
+		if (due != UINT64_MAX)
+			return due;
+		last = nvi_jitter_buffer_last(&s->jitter);
+	}
+	return nvi_signal_loss_tick(&s->loss, s->source, last, s->frame_interval_ns, now);
+}
+
+/* how long NVIRecvFrame may block without making a buffered frame late */
+static int32_t nvi_source_recv_timeout(nvi_source *s)
+{
+	/* with a standby or a pending receiver a stall is noticed, and
+	 * a fade advances, within a frame interval */
+	int32_t limit = NVI_RECV_TIMEOUT_MS;
+	if (s->standby || s->pending || nvi_signal_loss_active(&s->loss)) {
+		uint64_t interval_ms = s->frame_interval_ns / 1000000;
+		if (interval_ms < NVI_RECV_TIMEOUT_MS)
+			limit = interval_ms ? (int32_t)interval_ms : 1;
+	}
+	if (s->latency_mode != NVI_LATENCY_BUFFERED)
+		return limit;
+
+	uint64_t now = os_gettime_ns();
+	nvi_jitter_buffer_play(&s->jitter, s->source, now);
+
+	uint64_t due = nvi_jitter_buffer_next_due(&s->jitter);
+	if (due == UINT64_MAX)
+		return limit;
+	if (due <= now)
+		return 0;
+	uint64_t ms = (due - now + 999999) / 1000000;
+	return ms < (uint64_t)limit ? (int32_t)ms : limit;
+}
+
+static bool nvi_source_run_tasks(nvi_source *s)
+{
+	std::function<void()> func;
+	bool ran = false;
+	while (!s->should_quit && s->task_queue.try_dequeue(func)) {
+		func();
+		func = nullptr;
+		ran = true;
+	}
+	return ran;
+}
+
+/* the old receiver keeps the source going until the pending one has its
+ * first picture, or its first audio when it has no video, which goes
+ * straight out; returns true on the switch */
+static bool nvi_source_poll_pending(nvi_source *s, uint64_t now)
+{
+	bool video = !(s->pending_flags & NVI_RECV_NO_VIDEO);
+	for (int i = 0; i < 8; i++) {
+		NVIRecvFrameOut param{};
+		if (NVIRecvFrame(s->pending, &param) < 0) {
+			blog(LOG_WARNING, "nvi source '%s': %s receiver failed before its first frame",
+			     obs_source_get_name(s->source), nvi_recv_flags_name(s->pending_flags));
+			nvi_source_drop_pending(s);
+			nvi_source_schedule_retarget(s, now);
+			return false;
+		}
+		/* audio up to here came from the old receiver */
+		if (video ? !param.image_out : !param.wave_out) {
+			if (!param.image_out && !param.wave_out)
+				break;
+			continue;
+		}
+
+		NVIRecvFree(s->recver);
+		s->recver = s->pending;
+		s->recv_flags = s->pending_flags;
+		s->pending = 0;
+		s->pending_until = 0;
+		s->pending_window_ns = NVI_PENDING_TIMEOUT_NS;
+		s->retarget_at = 0;
+		s->retarget_ms = NVI_RETRY_MIN_MS;
+		s->last_intra_ns = 0;
+		s->last_frame_ns = now;
+		s->recv_switches++;
+		if (video)
+			nvi_source_output_video(s, param.image_out);
+		else
+			nvi_source_output_audio(s, param.wave_out);
+		blog(LOG_INFO, "nvi source '%s': switched to %s", obs_source_get_name(s->source),
+		     nvi_recv_flags_name(s->recv_flags));
+
+		/* the standby still has the old flags */
+		if (s->standby) {
+			nvi_source_drop_standby(s);
+			s->standby_at = now;
+		}
+		return true;
+	}
+
+	if (now >= s->pending_until) {
+		blog(LOG_WARNING, "nvi source '%s': nothing from the %s receiver, staying on %s",
+		     obs_source_get_name(s->source), nvi_recv_flags_name(s->pending_flags),
+		     nvi_recv_flags_name(s->recv_flags));
+		nvi_source_drop_pending(s);
+		s->pending_window_ns = s->pending_window_ns * 2 < NVI_PENDING_TIMEOUT_MAX_NS
+					       ? s->pending_window_ns * 2
+					       : NVI_PENDING_TIMEOUT_MAX_NS;
+		nvi_source_schedule_retarget(s, now);
+	}
+	return false;
+}
+
+/* returns true when a frame came in or the receiver was switched */
+static bool nvi_source_receive(nvi_source *s, bool block)
+{
+	NVIRecvFrameOut param{};
+	param.timeout_ms = nvi_source_recv_timeout(s);
+	/* a command posted while the last frame was handled runs first */
+	if (!block || s->task_queue.size_approx())
+		param.timeout_ms = 0;
+	uint64_t start = os_gettime_ns();
+	int nError = NVIRecvFrame(s->recver, &param);
+	uint64_t now = os_gettime_ns();
+	if (nError < 0) {
+		if (s->standby) {
+			nvi_source_failover(s, now, "receive failed");
+			return true;
+		}
+		nvi_source_schedule_retry(s);
+		return false;
+	}
+
+	bool got = param.image_out || param.wave_out;
+	if (got) {
+		s->retry_ms = NVI_RETRY_MIN_MS;
+		s->last_frame_ns = now;
+		if (s->switch_from_ns) {
+			uint64_t latency = now - s->switch_from_ns;
+			s->switch_last_ns = latency;
+			if (latency > s->switch_max_ns)
+				s->switch_max_ns = latency;
+			s->switch_from_ns = 0;
+		}
+	}
+	if (param.image_out) {
+		const NVIImageInfo *info = &param.image_out->info;
+		if (info->frame_rate_num && info->frame_rate_den)
+			s->frame_interval_ns = 1000000000ULL * info->frame_rate_den / info->frame_rate_num;
+		/* the proxy has its own gop, only the full stream's sizes the
+		 * wait for a switch back to it */
+		if (info->frame_kind == NVIFrameKind_Intra && !(s->recv_flags & NVI_RECV_PROXY)) {
+			if (s->last_intra_ns)
+				s->main_gop_ns = now - s->last_intra_ns;
+			s->last_intra_ns = now;
+		}
+		nvi_source_track_decode(s, param.image_out, now - start, now);
+		nvi_source_output_video(s, param.image_out);
+	}
+	if (param.wave_out) {
+		/* without video, audio is what tells the stream is back */
+		if (s->recv_flags & NVI_RECV_NO_VIDEO)
+			nvi_signal_loss_end(&s->loss, now);
+		nvi_source_output_audio(s, param.wave_out);
+	}
+
+	if (s->pending && nvi_source_poll_pending(s, now))
+		return true;
+	if (!s->pending && s->retarget_at && now >= s->retarget_at)
+		nvi_source_retarget(s);
+
+	if (s->standby) {
+		nvi_source_drain_standby(s, now);
+		/* only when the standby has had input since ours stopped, a silent
+		 * sender would otherwise bounce between the two */
+		if (!got && s->standby && s->last_frame_ns &&
+		    now - s->last_frame_ns > NVI_STALL_FRAMES * s->frame_interval_ns &&
+		    s->standby_last_ns > s->last_frame_ns) {
+			nvi_source_failover(s, now, "stream stalled");
+			return true;
+		}
+	} else if (s->standby_at && now >= s->standby_at) {
+		nvi_source_arm_standby(s);
+	}
+
+	if (!got && s->last_frame_ns && now - s->last_frame_ns > NVI_STALL_FRAMES * s->frame_interval_ns)
+		nvi_signal_loss_begin(&s->loss, s->last_frame_ns);
+	nvi_source_conceal(s, now);
+	return got;
+}
+
+/* the pool's non-blocking counterpart of one nvi_source_poll iteration */
+static nvi_recv_step nvi_source_step(void *data)
 {
 	auto s = (nvi_source *)data;
+	bool worked = nvi_source_run_tasks(s);
 
-	obs_source_audio obs_audio_frame = {0};
-	obs_source_frame obs_video_frame = {0};
+	if (s->recver)
+		return nvi_source_receive(s, false) || worked ? NVI_STEP_WORKED : NVI_STEP_POLLED;
+
+	uint64_t now = os_gettime_ns();
+	uint64_t next = nvi_source_conceal(s, now);
+	if (s->retry_at && now >= s->retry_at) {
+		nvi_source_connect(s);
+		return NVI_STEP_WORKED;
+	}
+	if (worked)
+		return NVI_STEP_WORKED;
+	if (s->retry_at && s->retry_at < next)
+		next = s->retry_at;
+	if (next == UINT64_MAX)
+		return NVI_STEP_IDLE;
+	s->task.due = next;
+	return NVI_STEP_WAITING;
+}
+
+void nvi_source_poll(void *data)
+{
+	auto s = (nvi_source *)data;
+	os_set_thread_name("nvi-source: receive");
 
 	while (!s->should_quit) {
-		std::function<void()> func;
-		auto ret = s->task_queue->try_dequeue(func);
-		if (ret) {
-			func();
-			func = nullptr;
-		}
-		if (!s->is_running || !s->recver) {
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		nvi_source_run_tasks(s);
+		if (s->should_quit)
+			break;
+
+		/* NVIRecvFrame can't be woken by a command: only block in it while
+		 * frames keep it returning, otherwise poll and wait on our own
+		 * semaphore so posting ends the wait */
+		if (s->recver) {
+			uint64_t now = os_gettime_ns();
+			if (s->last_frame_ns && now - s->last_frame_ns < NVI_RECV_TIMEOUT_MS * 1000000ULL) {
+				nvi_source_receive(s, true);
+			} else if (!nvi_source_receive(s, false) && s->recver) {
+				int32_t timeout_ms = nvi_source_recv_timeout(s);
+				if (timeout_ms > 0)
+					s->wake.wait((std::int64_t)timeout_ms * 1000);
+			}
 			continue;
 		}
 
-		NVIRecvFrameOut param{};
-		param.timeout_ms = 16;
-		int nError = NVIRecvFrame(s->recver, &param);
-		if (nError < 0) {
-			nvi_reconnect(data, s->cur_nvi_sites_alias);
-			std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+		/* nothing to receive: sleep until a command, the next retry or
+		 * the next concealment step */
+		uint64_t now = os_gettime_ns();
+		uint64_t next = nvi_source_conceal(s, now);
+		if (s->retry_at && now >= s->retry_at) {
+			nvi_source_connect(s);
 			continue;
-		} else {
-			if (param.image_out) {
-				if (param.image_out->buffer.format == _NVIPixelFormat::NVIPixel_422P) {
-					obs_video_frame.format = VIDEO_FORMAT_I422;
-					obs_video_frame.width = param.image_out->info.width;
-					obs_video_frame.height = param.image_out->info.height;
-					obs_video_frame.data[0] = (uint8_t *)param.image_out->buffer.planes[0];
-					obs_video_frame.linesize[0] = param.image_out->buffer.strides[0];
-					obs_video_frame.data[1] = (uint8_t *)param.image_out->buffer.planes[1];
-					obs_video_frame.linesize[1] = param.image_out->buffer.strides[1];
-					obs_video_frame.data[2] = (uint8_t *)param.image_out->buffer.planes[2];
-					obs_video_frame.linesize[2] = param.image_out->buffer.strides[2];
-				} else if (param.image_out->buffer.format == _NVIPixelFormat::NVIPixel_NV12) {
-					obs_video_frame.format = VIDEO_FORMAT_NV12;
-					obs_video_frame.width = param.image_out->info.width;
-					obs_video_frame.height = param.image_out->info.height;
-					obs_video_frame.data[0] = (uint8_t *)param.image_out->buffer.planes[0];
-					obs_video_frame.linesize[0] = param.image_out->buffer.strides[0];
-					obs_video_frame.data[1] = (uint8_t *)param.image_out->buffer.planes[1];
-					obs_video_frame.linesize[1] = param.image_out->buffer.strides[1];
-				} else {
-					blog(LOG_INFO, "unknown format");
-					continue;
-				}
-
-				// todo color sapce 601/709/2020
-				// nvi has no 601
-				// obs has no 2020
-				video_format_get_parameters(VIDEO_CS_709, VIDEO_RANGE_FULL,
-							    obs_video_frame.color_matrix,
-							    obs_video_frame.color_range_min,
-							    obs_video_frame.color_range_max);
-				obs_source_output_video(s->source, &obs_video_frame);
-			
-				
-			}
-			if (param.wave_out) {
-				obs_audio_frame.speakers = channel_count_to_layout(param.wave_out->info.channels);
-				obs_audio_frame.samples_per_sec = param.wave_out->info.sample_rate;
-				if (param.wave_out->info.depth == NVIWaveBit_F32)
-					obs_audio_frame.format = AUDIO_FORMAT_FLOAT;
-				else if (param.wave_out->info.depth == NVIWaveBit_16)
-					obs_audio_frame.format = AUDIO_FORMAT_16BIT;
-				else if (param.wave_out->info.depth == AUDIO_FORMAT_U8BIT)
-					obs_audio_frame.format = AUDIO_FORMAT_U8BIT;
-				else
-					obs_audio_frame.format = AUDIO_FORMAT_UNKNOWN;
-				obs_audio_frame.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
-								    std::chrono::steady_clock::now().time_since_epoch())
-								    .count(); //param.wave_out->info.time;
-				obs_audio_frame.frames = param.wave_out->buffer.samples;
-				auto sample_bytes = param.wave_out->buffer.align;
-				auto chan_bytes = param.wave_out->buffer.samples * sample_bytes;
-				/*for (int i = 0; i < param.wave_out->info.channels; i++) {
-					obs_audio_frame.data[i] = param.wave_out->buffer.data + i * chan_bytes;
-				}*/
-				/*for (int i = 0; i < param.wave_out->info.channels; i++) {
-					obs_audio_frame.data[i] = param.wave_out->buffer.data + i * chan_bytes;
-				}*/
-				obs_audio_frame.data[0] = param.wave_out->buffer.data;
-				
-				obs_source_output_audio(s->source, &obs_audio_frame);
-			}
 		}
+		if (s->retry_at && s->retry_at < next)
+			next = s->retry_at;
+		if (next == UINT64_MAX)
+			s->wake.wait();
+		else if (next > now)
+			s->wake.wait((std::int64_t)((next - now) / 1000));
 	}
 }
 
+static bool nvi_source_rescan(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(props);
+	UNUSED_PARAMETER(property);
+	UNUSED_PARAMETER(data);
+	nvi_discovery_refresh();
+	return false;
+}
+
+static void nvi_source_describe(nvi_source *s, char *text, size_t size)
+{
+	char jitter[256];
+	char recv[256];
+	char failover[256] = "";
+	char loss[256];
+	char decode[192];
+	nvi_jitter_buffer_describe(&s->jitter, jitter, sizeof(jitter));
+	nvi_signal_loss_describe(&s->loss, loss, sizeof(loss));
+	nvi_recv_pool_describe(&s->task, recv, sizeof(recv));
+	if (s->failover) {
+		const char *standby = s->standby_uri;
+		snprintf(failover, sizeof(failover), "\nfailover: standby %s, %llu switches, last %.1f ms, max %.1f ms",
+			 standby ? standby : "none", (unsigned long long)s->switches.load(),
+			 s->switch_last_ns / 1000000.0, s->switch_max_ns / 1000000.0);
+	}
+	uint64_t frames = s->decode_frames;
+	snprintf(decode, sizeof(decode),
+		 "Receiving %s on %s, %llu frames, avg %.2f ms, max %.2f ms, %llu receiver switches",
+		 nvi_recv_flags_name(s->recv_flags), nvi_accel_name(s->accel_used), (unsigned long long)frames,
+		 frames ? s->decode_total_ns / 1000000.0 / frames : 0.0, s->decode_max_ns / 1000000.0,
+		 (unsigned long long)s->recv_switches.load());
+	snprintf(text, size, "%s\n%s\n%s\n%s%s", recv, decode, jitter, loss, failover);
+}
+
+static bool nvi_source_refresh_stats(obs_properties_t *props, obs_property_t *property, void *data)
+{
+	UNUSED_PARAMETER(property);
+	auto s = (struct nvi_source *)data;
+	char stats[1024];
+	nvi_source_describe(s, stats, sizeof(stats));
+	obs_property_set_description(obs_properties_get(props, PROP_STATS), stats);
+	return true;
+}
+
 obs_properties_t *nvi_source_getproperties(void *data)
 {
 	auto s = (struct nvi_source *)data;
@@ -182,40 +1022,202 @@ obs_properties_t *nvi_source_getproperties(void *data)
 	obs_properties_set_flags(props, OBS_PROPERTIES_DEFER_UPDATE);
 
 	obs_property_t *source_list = obs_properties_add_list(props, PROP_SOURCE, PROP_SOURCE,OBS_COMBO_TYPE_EDITABLE,OBS_COMBO_FORMAT_STRING);
-	nvi_discovery();
-	for (int i = 0; i < g_nvi_streams.size(); i++) {
-		if (g_nvi_streams[i].alias) {
-			QString str = QString(g_nvi_streams[i].sites) + ":" + QString(g_nvi_streams[i].alias);
-			obs_property_list_add_string(source_list, str.toStdString().c_str(), str.toStdString().c_str());
-		}
+	/* the cached directory, the dialog is refreshed when it changes */
+	nvi_stream_snapshot dir = nvi_discovery_snapshot();
+	for (auto &stream : dir->streams)
+		obs_property_list_add_string(source_list, stream.key, stream.key);
+	obs_properties_add_button2(props, PROP_RESCAN, "Rescan Network", nvi_source_rescan, s);
+
+	obs_property_t *p = obs_properties_add_list(props, PROP_LATENCY_MODE, "Latency Mode", OBS_COMBO_TYPE_LIST,
+						    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Normal", NVI_LATENCY_NORMAL);
+	obs_property_list_add_int(p, "Ultra-Low Latency (Bypass)", NVI_LATENCY_ULTRA_LOW);
+	obs_property_list_add_int(p, "Jitter Buffer", NVI_LATENCY_BUFFERED);
+
+	p = obs_properties_add_int(props, PROP_JITTER_TARGET, "Jitter Buffer Target (ms)", 0, 1000, 10);
+	obs_property_set_long_description(p, "Delay added after the stream's own timestamps before a frame is shown");
+	obs_properties_add_int(props, PROP_JITTER_MIN, "Jitter Buffer Min Frames", 0, 30, 1);
+	obs_properties_add_int(props, PROP_JITTER_MAX, "Jitter Buffer Max Frames", 1, 60, 1);
+
+	p = obs_properties_add_list(props, PROP_RECV_THREAD, "Receive Thread", OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Dedicated", 0);
+	obs_property_list_add_int(p, "Shared Pool", 1);
+	obs_property_set_long_description(
+		p, "The shared pool multiplexes many sources over half as many threads as there are cores");
+
+	p = obs_properties_add_list(props, PROP_ACCEL, "Decode Accelerator", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Auto", NVIAccel_Auto);
+	obs_property_list_add_int(p, "CPU", NVIAccel_CPU);
+	/* only what the platform's nvi library can open */
+#ifdef WIN32
+	obs_property_list_add_int(p, "D3D11VA", NVIAccel_D3D11VA);
+	obs_property_list_add_int(p, "DXVA2", NVIAccel_DXVA2);
+#else
+	obs_property_list_add_int(p, "VAAPI", NVIAccel_VAAPI);
+#endif
+	obs_property_list_add_int(p, "NVCodec", NVIAccel_NVCodec);
+	obs_property_set_long_description(p, "Falls back to CPU when the accelerator cannot be set up");
+#ifndef WIN32
+	p = obs_properties_add_text(props, PROP_ACCEL_DRM, "VAAPI DRM Device", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(p, "Render node for VAAPI, like /dev/dri/renderD128");
+#endif
+
+	p = obs_properties_add_list(props, PROP_LOSS_POLICY, "On Signal Loss", OBS_COMBO_TYPE_LIST,
+				    OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Hold Last Frame", NVI_LOSS_HOLD);
+	obs_property_list_add_int(p, "Fade to Black", NVI_LOSS_FADE);
+	obs_property_list_add_int(p, "Show Slate", NVI_LOSS_SLATE);
+	obs_property_set_long_description(p, "Fade to Black needs the Buffered latency mode and YUV video, otherwise "
+					     "it shows the slate, or holds the last frame without one");
+	p = obs_properties_add_int(props, PROP_LOSS_TIMEOUT, "Signal Loss Timeout (s)", 0, 3600, 1);
+	obs_property_set_long_description(p, "After this the source goes blank and reports inactive, 0 never does");
+	obs_properties_add_path(props, PROP_LOSS_SLATE, "Slate Image", OBS_PATH_FILE,
+				"Image Files (*.png *.jpg *.jpeg *.bmp *.gif)", nullptr);
+
+	p = obs_properties_add_list(props, PROP_MEDIA, "Receive", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+	obs_property_list_add_int(p, "Audio and Video", NVI_MEDIA_AV);
+	obs_property_list_add_int(p, "Audio Only", NVI_MEDIA_AUDIO);
+	obs_property_list_add_int(p, "Video Only", NVI_MEDIA_VIDEO);
+	p = obs_properties_add_bool(props, PROP_AUDIO_WHEN_HIDDEN, "Audio Only When Hidden");
+	obs_property_set_long_description(p, "Stops receiving and decoding video while no view shows the source");
+
+	p = obs_properties_add_bool(props, PROP_PROXY, "Proxy When Not on Program");
+	obs_property_set_long_description(
+		p, "Receives the sender's proxy video while the source is only in preview or a multiview, "
+		   "and the full stream while it is on program");
+
+	p = obs_properties_add_bool(props, PROP_FAILOVER, "Fast Failover (Warm Standby)");
+	obs_property_set_long_description(
+		p, "Keeps a second receiver open and switches to it within a frame interval when the stream fails");
+	p = obs_properties_add_text(props, PROP_STANDBY_LOCAL, "Standby Local Interface", OBS_TEXT_DEFAULT);
+	obs_property_set_long_description(
+		p, "IP or adapter name for the standby path. Empty uses the same alias announced from another site");
+
+	p = obs_properties_add_text(props, PROP_STATS, "", OBS_TEXT_INFO);
+	if (s) {
+		char stats[1024];
+		nvi_source_describe(s, stats, sizeof(stats));
+		obs_property_set_description(p, stats);
 	}
-	
+	obs_properties_add_button2(props, PROP_STATS_REFRESH, "Refresh Stats", nvi_source_refresh_stats, s);
+
 	return props;
 }
 void nvi_source_getdefaults(obs_data_t *settings)
 {
-	
+	obs_data_set_default_int(settings, PROP_LATENCY_MODE, NVI_LATENCY_NORMAL);
+	obs_data_set_default_int(settings, PROP_JITTER_TARGET, 80);
+	obs_data_set_default_int(settings, PROP_JITTER_MIN, 2);
+	obs_data_set_default_int(settings, PROP_JITTER_MAX, 8);
+	obs_data_set_default_int(settings, PROP_RECV_THREAD, 0);
+	obs_data_set_default_int(settings, PROP_ACCEL, NVIAccel_Auto);
+	obs_data_set_default_string(settings, PROP_ACCEL_DRM, "/dev/dri/renderD128");
+	obs_data_set_default_int(settings, PROP_LOSS_POLICY, NVI_LOSS_HOLD);
+	obs_data_set_default_int(settings, PROP_LOSS_TIMEOUT, 10);
+	obs_data_set_default_int(settings, PROP_MEDIA, NVI_MEDIA_AV);
+	obs_data_set_default_bool(settings, PROP_AUDIO_WHEN_HIDDEN, true);
+	obs_data_set_default_bool(settings, PROP_PROXY, false);
+	obs_data_set_default_bool(settings, PROP_FAILOVER, false);
+}
+
+
+/* queued commands and the receiver itself carry over to the new runner */
+static void nvi_source_stop(nvi_source *s)
+{
+	if (s->thread.joinable()) {
+		nvi_source_post(s, [=] {
+			s->should_quit = true;
+		});
+		s->thread.join();
+	}
+	if (s->pooled) {
+		nvi_recv_pool_detach(&s->task);
+		s->pooled = false;
+	}
 }
 
+static void nvi_source_start(nvi_source *s, bool pooled)
+{
+	if (pooled == s->pooled && (pooled || s->thread.joinable()))
+		return;
+
+	nvi_source_stop(s);
+	s->should_quit = false;
+	if (pooled) {
+		s->task.step = nvi_source_step;
+		s->task.data = s;
+		s->pooled = true;
+		nvi_recv_pool_attach(&s->task);
+		return;
+	}
+
+	s->thread = std::thread(nvi_source_poll, s);
+	auto threadHandle = s->thread.native_handle();
+
+	#ifdef WIN32
+	SetThreadPriority(threadHandle, THREAD_PRIORITY_HIGHEST);
+	#endif
+}
 
 void nvi_source_update(void *data, obs_data_t *settings)
 {
 	auto s = (struct nvi_source *)data;
-	if (!s->pthread) {
-		s->pthread = new std::thread(nvi_source_poll, data);
-		auto threadHandle = s->pthread->native_handle();
+	nvi_source_start(s, obs_data_get_int(settings, PROP_RECV_THREAD) == 1);
 
-		#ifdef WIN32
-		SetThreadPriority(threadHandle, THREAD_PRIORITY_HIGHEST);
-		#endif
+	auto mode = (nvi_latency_mode)obs_data_get_int(settings, PROP_LATENCY_MODE);
+	auto target_ms = (uint32_t)obs_data_get_int(settings, PROP_JITTER_TARGET);
+	auto min_frames = (size_t)obs_data_get_int(settings, PROP_JITTER_MIN);
+	auto max_frames = (size_t)obs_data_get_int(settings, PROP_JITTER_MAX);
+	obs_source_set_async_unbuffered(s->source, mode == NVI_LATENCY_ULTRA_LOW);
+	nvi_source_post(s, [=]() {
+		s->latency_mode = mode;
+		nvi_jitter_buffer_configure(&s->jitter, target_ms, min_frames, max_frames);
+		if (mode != NVI_LATENCY_BUFFERED)
+			nvi_jitter_buffer_flush(&s->jitter);
+	});
 
-	}
+	auto loss_policy = (nvi_loss_policy)obs_data_get_int(settings, PROP_LOSS_POLICY);
+	auto loss_timeout = (uint32_t)obs_data_get_int(settings, PROP_LOSS_TIMEOUT);
+	std::string slate = obs_data_get_string(settings, PROP_LOSS_SLATE);
+	nvi_source_post(s, [=]() {
+		nvi_signal_loss_configure(&s->loss, loss_policy, loss_timeout, slate.c_str());
+	});
 
-	QString sites_alias = obs_data_get_string(settings, PROP_SOURCE);
-	if (sites_alias.isEmpty())
-		return;
-	s->task_queue->enqueue([=]() {
-		nvi_reconnect(data, sites_alias);
+	auto media = (nvi_media_mode)obs_data_get_int(settings, PROP_MEDIA);
+	bool audio_when_hidden = obs_data_get_bool(settings, PROP_AUDIO_WHEN_HIDDEN);
+	bool proxy = obs_data_get_bool(settings, PROP_PROXY);
+	nvi_source_post(s, [=]() {
+		s->media = media;
+		s->audio_when_hidden = audio_when_hidden;
+		s->proxy_mode = proxy;
+		nvi_source_retarget(s);
+	});
+
+	bool failover = obs_data_get_bool(settings, PROP_FAILOVER);
+	std::string standby_local = obs_data_get_string(settings, PROP_STANDBY_LOCAL);
+	nvi_source_post(s, [=]() {
+		if (!failover || standby_local != s->standby_local)
+			nvi_source_drop_standby(s);
+		s->failover = failover;
+		s->standby_local = standby_local;
+		if (failover && s->recver && !s->standby)
+			s->standby_at = os_gettime_ns();
+	});
+
+	/* receiver flags follow the media settings through the retarget
+	 * above, only a new stream or accelerator needs new receivers */
+	auto accel = (int32_t)obs_data_get_int(settings, PROP_ACCEL);
+	std::string accel_drm = obs_data_get_string(settings, PROP_ACCEL_DRM);
+	std::string sites_alias = obs_data_get_string(settings, PROP_SOURCE);
+	nvi_source_post(s, [=]() {
+		bool accel_changed = accel != s->accel || accel_drm != s->accel_drm;
+		s->accel = accel;
+		s->accel_drm = accel_drm;
+		if (sites_alias.empty())
+			return;
+		if (accel_changed || sites_alias != s->stream_key)
+			nvi_reconnect(data, sites_alias);
 	});
 
 
@@ -224,51 +1226,84 @@ void nvi_source_update(void *data, obs_data_t *settings)
 }
 
 
+/* shown covers any view, hidden sources can drop to audio only */
 void nvi_source_shown(void *data)
 {
 	auto s = (struct nvi_source *)data;
-	
+	nvi_source_post(s, [=] {
+		s->shown = true;
+		nvi_source_retarget(s);
+	});
 }
 
 void nvi_source_hidden(void *data)
 {
 	auto s = (struct nvi_source *)data;
-	
+	nvi_source_post(s, [=] {
+		s->shown = false;
+		nvi_source_retarget(s);
+	});
 }
 
+/* active means on program, anything else (preview, multiview) can run
+ * on the proxy */
 void nvi_source_activated(void *data)
 {
 	auto s = (struct nvi_source *)data;
-	
+	nvi_source_post(s, [=] {
+		s->on_program = true;
+		nvi_source_retarget(s);
+	});
 }
 
 void nvi_source_deactivated(void *data)
 {
 	auto s = (struct nvi_source *)data;
+	nvi_source_post(s, [=] {
+		s->on_program = false;
+		nvi_source_retarget(s);
+	});
+}
 
+/* runs on the discovery thread */
+static void nvi_source_directory_changed(void *data)
+{
+	auto s = (struct nvi_source *)data;
+	obs_source_update_properties(s->source);
 
+	/* a stream we were waiting for may have shown up */
+	nvi_source_post(s, [=] {
+		if (!s->recver && s->retry_at)
+			s->retry_at = os_gettime_ns();
+		/* or a redundant sender for the standby */
+		if (s->failover && s->recver && !s->standby)
+			s->standby_at = os_gettime_ns();
+	});
 }
 
 void *nvi_source_create(obs_data_t *settings, obs_source_t *source)
 {
-	auto s = (struct nvi_source *)bzalloc(sizeof(struct nvi_source));
-	s->task_queue = new ConcurrentQueue<std::function<void()>>();
+	auto s = new nvi_source();
 	s->source = source;
 	nvi_source_update(s, settings);
+	nvi_discovery_add_callback(nvi_source_directory_changed, s);
+	blog(LOG_INFO, "nvi source '%s' created: instance %zu bytes, plugin total %zu bytes",
+	     obs_source_get_name(source), sizeof(nvi_source), nvi_mem_usage());
 	return s;
 }
 
 void nvi_source_destroy(void *data)
 {
 	auto s = (struct nvi_source *)data;
-	s->is_running = false;
-	s->task_queue->enqueue([=] {
-		s->should_quit = true;
-	});
-	s->pthread->join();
-	if (s->task_queue)
-		delete s->task_queue;
-	bfree(s);
+	nvi_discovery_remove_callback(nvi_source_directory_changed, s);
+	nvi_source_stop(s);
+	nvi_jitter_buffer_free(&s->jitter);
+	nvi_signal_loss_free(&s->loss);
+	nvi_source_drop_standby(s);
+	nvi_source_drop_pending(s);
+	if (s->recver)
+		NVIRecvFree(s->recver);
+	delete s;
 }
 
 struct obs_source_info create_nvi_source_info()
@@ -0,0 +1,295 @@
+/* checks the planar -> packed float kernels against the template they
+ * replaced, the pack and deinterleave kernels against plain scalar loops,
+ * and reports throughput; exits non-zero on a mismatch */
+#include "nvi-audio-convert.h"
+#include <chrono>
+#include <limits>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+/* the original conversion from nvi-output.cpp, kept as the reference */
+template<class T> void PlanarToPackedFloat(T **planars, float *packed, int sampleCountPerChan, int noChan)
+{
+	T max_value = std::numeric_limits<T>::max();
+	for (int i = 0; i < sampleCountPerChan; i++) {
+		for (int ch = 0; ch < noChan; ch++) {
+			if (std::is_floating_point<T>::value) {
+				packed[i * noChan + ch] = float(planars[ch][i]);
+			} else {
+				packed[i * noChan + ch] = float(planars[ch][i]) / float(max_value);
+			}
+		}
+	}
+}
+
+static uint32_t test_seed = 0x12345678u;
+
+static uint32_t test_random()
+{
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 17;
+	test_seed ^= test_seed << 5;
+	return test_seed;
+}
+
+template<class T> static T test_sample()
+{
+	if (std::is_floating_point<T>::value)
+		return (T)((float)(test_random() & 0xffff) / 32768.0f - 1.0f);
+	return (T)test_random();
+}
+
+template<class T> struct test_planes {
+	std::vector<std::vector<T>> data;
+	std::vector<T *> typed;
+	std::vector<const uint8_t *> raw;
+
+	test_planes(size_t channels, size_t frames) : data(channels), typed(channels), raw(channels)
+	{
+		for (size_t ch = 0; ch < channels; ch++) {
+			/* one spare sample so a kernel reading past the end shows in asan */
+			data[ch].resize(frames + 1);
+			for (auto &v : data[ch])
+				v = test_sample<T>();
+			typed[ch] = data[ch].data();
+			raw[ch] = (const uint8_t *)data[ch].data();
+		}
+	}
+};
+
+template<class T> static bool test_compare(nvi_sample_type type, const char *name, size_t channels, size_t frames)
+{
+	test_planes<T> planes(channels, frames);
+	size_t samples = channels * frames;
+	std::vector<float> expected(samples), actual(samples + 1, 12345.0f);
+
+	PlanarToPackedFloat<T>(planes.typed.data(), expected.data(), (int)frames, (int)channels);
+	nvi_planar_to_packed_float(type, planes.raw.data(), actual.data(), frames, channels);
+
+	/* 1/max multiplies where the template divided, allow an ulp or two */
+	for (size_t i = 0; i < samples; i++) {
+		if (fabsf(actual[i] - expected[i]) > 1e-6f * (fabsf(expected[i]) + 1.0f)) {
+			fprintf(stderr, "FAIL %s %zu ch %zu frames: sample %zu is %g, expected %g\n", name, channels,
+				frames, i, actual[i], expected[i]);
+			return false;
+		}
+	}
+	if (actual[samples] != 12345.0f) {
+		fprintf(stderr, "FAIL %s %zu ch %zu frames: wrote past the end\n", name, channels, frames);
+		return false;
+	}
+	return true;
+}
+
+template<class T> static void test_throughput(nvi_sample_type type, const char *name, size_t channels)
+{
+	const size_t frames = 1024;
+	const int rounds = 4000;
+	test_planes<T> planes(channels, frames);
+	std::vector<float> packed(frames * channels);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		PlanarToPackedFloat<T>(planes.typed.data(), packed.data(), (int)frames, (int)channels);
+	auto middle = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++)
+		nvi_planar_to_packed_float(type, planes.raw.data(), packed.data(), frames, channels);
+	auto end = std::chrono::steady_clock::now();
+
+	double samples = (double)frames * channels * rounds;
+	double old_s = std::chrono::duration<double>(middle - start).count();
+	double new_s = std::chrono::duration<double>(end - middle).count();
+	printf("  %-3s %zu ch: template %8.1f Msamples/s, kernel %8.1f Msamples/s (%.1fx)\n", name, channels,
+	       samples / old_s / 1e6, samples / new_s / 1e6, old_s / new_s);
+}
+
+/* none but 1024 are multiples of the 4 or 8 lane kernels */
+static const size_t frame_counts[] = {0, 1, 3, 7, 13, 31, 1023, 1024, 1029};
+
+/* interleaved nvi pcm -> planes, what obs' own conversion does */
+template<class T> static void test_deinterleave_reference(const T *packed, float *const *planes, size_t frames, size_t channels)
+{
+	float scale = std::is_floating_point<T>::value ? 1.0f : 1.0f / 32768.0f;
+	for (size_t i = 0; i < frames; i++)
+		for (size_t ch = 0; ch < channels; ch++)
+			planes[ch][i] = float(packed[i * channels + ch]) * scale;
+}
+
+template<class T> static bool test_deinterleave(nvi_sample_type type, const char *name, size_t channels, size_t frames)
+{
+	std::vector<T> packed(channels * frames + 1);
+	for (auto &v : packed)
+		v = test_sample<T>();
+
+	std::vector<std::vector<float>> expected(channels), actual(channels);
+	std::vector<float *> expected_planes(channels), actual_planes(channels);
+	for (size_t ch = 0; ch < channels; ch++) {
+		expected[ch].resize(frames);
+		actual[ch].assign(frames + 1, 12345.0f);
+		expected_planes[ch] = expected[ch].data();
+		actual_planes[ch] = actual[ch].data();
+	}
+
+	test_deinterleave_reference<T>(packed.data(), expected_planes.data(), frames, channels);
+	nvi_packed_to_planar_float(type, (const uint8_t *)packed.data(), actual_planes.data(), frames, channels);
+
+	for (size_t ch = 0; ch < channels; ch++) {
+		for (size_t i = 0; i < frames; i++) {
+			if (actual[ch][i] != expected[ch][i]) {
+				fprintf(stderr, "FAIL deinterleave %s %zu ch %zu frames: ch %zu sample %zu is %g, expected %g\n",
+					name, channels, frames, ch, i, actual[ch][i], expected[ch][i]);
+				return false;
+			}
+		}
+		if (actual[ch][frames] != 12345.0f) {
+			fprintf(stderr, "FAIL deinterleave %s %zu ch %zu frames: wrote past the end\n", name, channels,
+				frames);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* clamp, scale and round to nearest even, the undithered scalar kernel */
+static int32_t test_pack_reference(float v, int bits)
+{
+	float full = bits == 16 ? 32767.0f : 8388607.0f;
+	v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+	return (int32_t)lrintf(v * full);
+}
+
+static int32_t test_pack_read(const uint8_t *out, size_t i, int bits)
+{
+	if (bits == 16) {
+		int16_t v;
+		memcpy(&v, out + i * 2, sizeof(v));
+		return v;
+	}
+	/* sign extend the little-endian 3 bytes */
+	uint32_t v = (uint32_t)out[i * 3] | ((uint32_t)out[i * 3 + 1] << 8) | ((uint32_t)out[i * 3 + 2] << 16);
+	return (int32_t)(v << 8) >> 8;
+}
+
+/* full scale, past full scale, exact halves and random values in between */
+static std::vector<float> test_pack_input(size_t samples)
+{
+	static const float edges[] = {0.0f, 1.0f, -1.0f, 1.5f, -1.5f, 0.5f / 32767.0f, -0.5f / 32767.0f, 1e-9f};
+	std::vector<float> in(samples);
+	for (size_t i = 0; i < samples; i++)
+		in[i] = i < sizeof(edges) / sizeof(edges[0]) ? edges[i] : test_sample<float>() * 1.1f;
+	return in;
+}
+
+static void test_pack_run(int bits, const float *in, uint8_t *out, size_t samples, nvi_dither *dither)
+{
+	if (bits == 16)
+		nvi_packed_float_to_s16(in, out, samples, dither);
+	else
+		nvi_packed_float_to_s24(in, out, samples, dither);
+}
+
+/* in place packs over the float buffer itself, as the output does */
+static bool test_pack(int bits, size_t samples, bool in_place)
+{
+	size_t width = (size_t)bits / 8;
+	std::vector<float> in = test_pack_input(samples);
+	std::vector<float> buffer(in);
+	buffer.push_back(12345.0f);
+
+	std::vector<uint8_t> separate(samples * width + 1, 0xa5);
+	uint8_t *out = in_place ? (uint8_t *)buffer.data() : separate.data();
+	test_pack_run(bits, buffer.data(), out, samples, nullptr);
+
+	for (size_t i = 0; i < samples; i++) {
+		int32_t expected = test_pack_reference(in[i], bits);
+		int32_t actual = test_pack_read(out, i, bits);
+		if (actual != expected) {
+			fprintf(stderr, "FAIL s%d%s %zu samples: sample %zu (%g) is %d, expected %d\n", bits,
+				in_place ? " in place" : "", samples, i, in[i], actual, expected);
+			return false;
+		}
+	}
+	if (in_place ? buffer[samples] != 12345.0f : separate[samples * width] != 0xa5) {
+		fprintf(stderr, "FAIL s%d%s %zu samples: wrote past the end\n", bits, in_place ? " in place" : "",
+			samples);
+		return false;
+	}
+	return true;
+}
+
+/* lanes draw their own noise, so dithered output only matches the scalar
+ * kernel statistically: within one lsb of the undithered value, in range,
+ * and not all equal to it; near full scale a float only resolves half an
+ * s24 lsb, so adding the noise can round one more step there */
+static bool test_pack_dither(int bits, size_t samples)
+{
+	int32_t full = bits == 16 ? 32767 : 8388607;
+	int32_t slack = bits == 16 ? 1 : 2;
+	std::vector<float> in = test_pack_input(samples);
+	std::vector<uint8_t> out(samples * (size_t)bits / 8);
+
+	nvi_dither dither;
+	nvi_dither_init(&dither, 1);
+	nvi_dither before = dither;
+	test_pack_run(bits, in.data(), out.data(), samples, &dither);
+
+	size_t changed = 0;
+	for (size_t i = 0; i < samples; i++) {
+		int32_t expected = test_pack_reference(in[i], bits);
+		int32_t actual = test_pack_read(out.data(), i, bits);
+		if (actual < expected - slack || actual > expected + slack || actual < -full - 1 || actual > full) {
+			fprintf(stderr, "FAIL s%d dither %zu samples: sample %zu (%g) is %d, expected %d +-%d\n", bits,
+				samples, i, in[i], actual, expected, slack);
+			return false;
+		}
+		changed += actual != expected;
+	}
+	if (samples >= 1023 && (changed < samples / 8 || !memcmp(&before, &dither, sizeof(dither)))) {
+		fprintf(stderr, "FAIL s%d dither %zu samples: only %zu samples dithered\n", bits, samples, changed);
+		return false;
+	}
+	return true;
+}
+
+template<class T> static bool test_type(nvi_sample_type type, const char *name)
+{
+	static const size_t channel_counts[] = {1, 2, 3, 4, 5, 6, 7, 8, 16};
+
+	bool ok = true;
+	for (size_t channels : channel_counts)
+		for (size_t frames : frame_counts)
+			ok &= test_compare<T>(type, name, channels, frames);
+
+	for (size_t channels : channel_counts)
+		test_throughput<T>(type, name, channels);
+	return ok;
+}
+
+int main()
+{
+	printf("nvi audio convert kernels: %s\n", nvi_audio_convert_isa());
+
+	bool ok = true;
+	ok &= test_type<float>(NVI_SAMPLE_F32, "f32");
+	ok &= test_type<int16_t>(NVI_SAMPLE_S16, "s16");
+	ok &= test_type<uint8_t>(NVI_SAMPLE_U8, "u8");
+
+	for (size_t channels : {1, 2, 3, 4, 5, 6, 7, 8, 16})
+		for (size_t frames : frame_counts) {
+			ok &= test_deinterleave<int16_t>(NVI_SAMPLE_S16, "s16", channels, frames);
+			ok &= test_deinterleave<float>(NVI_SAMPLE_F32, "f32", channels, frames);
+		}
+
+	for (size_t samples : frame_counts)
+		for (int bits : {16, 24}) {
+			ok &= test_pack(bits, samples, false);
+			ok &= test_pack(bits, samples, true);
+			ok &= test_pack_dither(bits, samples);
+		}
+
+	printf("%s\n", ok ? "all kernels match the reference" : "MISMATCH");
+	return ok ? 0 : 1;
+}